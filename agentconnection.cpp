@@ -5,10 +5,17 @@
 #include <QCoreApplication>
 #include <QtEndian>
 #include <QTimer>
+#include <QMutexLocker>
+#if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
+#include <QRandomGenerator>
+#endif
 #include <QSslSocket>
 #include <crypto.h>
-#include <utils.h>
+#include <threaddispatcher.h>
+#include <msgpackutf8.h>
 
+#include <algorithm>
+#include <climits>
 #include <functional>
 
 Entity::Entity(int ronum, const char *data, int length, QObject* parent)
@@ -28,6 +35,16 @@ Entity::Entity(int ronum, const char *data, int length, QObject* parent)
     Q_ASSERT(ronum == bwpo::num::ROEntity);
 
     const char* content = this->content();
+    const int len = this->length();
+    this->expires = 0;
+    this->created = 0;
+    this->signedLength = 0;
+    //Received entities are untrusted, so nothing is read past length
+    if (len < 32)
+    {
+        qWarning("Entity too short");
+        return;
+    }
     this->vk = QByteArray::fromRawData(content, 32);
 
     int idx = 32;
@@ -35,47 +52,62 @@ Entity::Entity(int ronum, const char *data, int length, QObject* parent)
 
     forever
     {
+        if (idx >= len)
+        {
+            qWarning("Entity has no end of options");
+            return;
+        }
+        if (content[idx] == 0x00) // End
+        {
+            idx++;
+            break;
+        }
+        if (idx + 2 > len || idx + 2 + (uchar) content[idx + 1] > len)
+        {
+            qWarning("Entity option runs past the end");
+            return;
+        }
+        ln = (uchar) content[idx + 1];
+        const char *val = &content[idx + 2];
         switch (content[idx])
         {
         case 0x02: // Creation date
-            Q_ASSERT_X(content[idx + 1] == 8, "Entity", "invalid creation date");
-            idx += 2;
-            this->created = qFromLittleEndian<qint64>((const unsigned char*) &content[idx]);
-            idx += 8;
+            if (ln == 8)
+                this->created = qFromLittleEndian<qint64>((const unsigned char*) val);
+            else
+                qWarning("Entity has an invalid creation date");
             break;
         case 0x03: // Expiry date
-            Q_ASSERT_X(content[idx + 1] == 8, "Entity", "invalid expiry date");
-            idx += 2;
-            this->created = qFromLittleEndian<qint64>((const unsigned char*) &content[idx]);
-            idx += 8;
+            if (ln == 8)
+                this->expires = qFromLittleEndian<qint64>((const unsigned char*) val);
+            else
+                qWarning("Entity has an invalid expiry date");
             break;
         case 0x04: // Delegated revoker
-            Q_ASSERT_X(content[idx + 1] == 32, "Entity", "invalid delegated revoker");
-            idx += 2;
-            this->revokers.append(QByteArray::fromRawData(&content[idx], 32));
-            idx += 32;
+            if (ln == 32)
+                this->revokers.append(QByteArray::fromRawData(val, 32));
+            else
+                qWarning("Entity has an invalid delegated revoker");
             break;
         case 0x05: // Contact
-            ln = (int) content[idx + 1];
-            this->contact = QString(QByteArray::fromRawData(&content[idx + 2], ln));
-            idx += (2 + ln);
+            this->contact = MsgPack::fromUtf8(val, ln);
             break;
         case 0x06: // Comment
-            ln = (int) content[idx + 1];
-            this->comment = QString(QByteArray::fromRawData(&content[idx + 2], ln));
-            idx += (2 + ln);
+            this->comment = MsgPack::fromUtf8(val, ln);
             break;
-        case 0x00: // End
-            idx++;
-            goto done;
         default:
             qWarning("Unknown Entity option type: %d", content[idx]);
-            idx += (1 + (int) content[idx + 1]);
             break;
         }
+        idx += 2 + ln;
     }
 
-done:
+    if (idx + 64 > len)
+    {
+        qWarning("Entity has no signature");
+        return;
+    }
+    this->signedLength = idx;
     this->sig = QByteArray::fromRawData(&content[idx], 64);
     if (this->sk.isNull())
     {
@@ -83,6 +115,63 @@ done:
     }
 }
 
+bool Entity::verify()
+{
+    if (this->sig.length() != 64 || this->vk.length() != 32)
+    {
+        return false;
+    }
+    QByteArray signedPart = QByteArray::fromRawData(this->content(), this->signedLength);
+    return VerifyBlob(this->vk, this->sig, signedPart);
+}
+
+bool RoutingObject::verifyItem(VerifyItem *item)
+{
+    switch (m_ronum)
+    {
+    case bwpo::num::ROEntity:
+    case bwpo::num::ROEntityWKey:
+    case bwpo::num::ROAccessDOT:
+    case bwpo::num::ROPermissionDOT:
+    case bwpo::num::RORevocation:
+        break;
+    default:
+        return false;
+    }
+    const char *content = this->content();
+    int length = this->length();
+    //Entity objects skip the secret key already, plain received ones do not
+    if (m_ronum == bwpo::num::ROEntityWKey && this->offset == 0)
+    {
+        content += 32;
+        length -= 32;
+    }
+    //The key that signed the object, and at least one byte of it
+    if (length < 32 + 1 + 64)
+    {
+        return false;
+    }
+    int signedLength = length - 64;
+    item->vk = QByteArray::fromRawData(content, 32);
+    item->sig = QByteArray::fromRawData(content + signedLength, 64);
+    item->data = QByteArray::fromRawData(content, signedLength);
+    return true;
+}
+
+bool RoutingObject::signatureValid()
+{
+    int known = m_signature.loadAcquire();
+    if (known != 0)
+    {
+        return known == 1;
+    }
+    VerifyItem item;
+    bool valid = verifyItem(&item) && VerifyBlob(item.vk, item.sig, item.data);
+    //Racing threads all reach the same answer
+    m_signature.storeRelease(valid ? 1 : 2);
+    return valid;
+}
+
 QByteArray Entity::getSigningBlob()
 {
     QByteArray rv;
@@ -99,90 +188,399 @@ QByteArray Entity::getSigningBlob()
 }
 
 
-PFrame AgentConnection::newFrame(const char *type, quint32 seqno)
+PFrame AgentConnection::newFrame(const char *type, quint32 seqno, int arenaSize)
 {
     if (seqno == 0)
         seqno = getSeqNo();
+    if (arenaSize > 0)
+        return Frame::createWithArena(this, type, seqno, arenaSize);
     auto rv = new Frame(this, type, seqno);
     return QSharedPointer<Frame>(rv);
 }
 
+PFrame Frame::createWithArena(AgentConnection *agent, const char *type, quint32 seqno, int arenaSize)
+{
+    size_t head = alignUp(sizeof(Frame));
+    char *mem = static_cast<char*>(::operator new(head + arenaSize));
+    Frame *f = new (mem) Frame(agent, type, seqno);
+    f->m_arena = mem + head;
+    f->m_arenaSize = arenaSize;
+    return PFrame(f, &Frame::destroyWithArena);
+}
+
+void Frame::destroyWithArena(Frame *f)
+{
+    f->~Frame();
+    ::operator delete(f);
+}
+
 Frame::~Frame()
 {
-    qDeleteAll(pos);
-    qDeleteAll(headers);
-    qDeleteAll(ros);
+    foreach (auto po, pos)
+        release(po);
+    foreach (auto h, headers)
+        release(h);
+    foreach (auto ro, ros)
+    {
+        bool shared = false;
+        foreach (auto s, m_sharedRos)
+            shared |= s.data() == ro;
+        if (!shared)
+            release(ro);
+    }
 }
 
 quint32 AgentConnection::getSeqNo()
 {
     return (quint32)(seqno++);
 }
+namespace
+{
+    //A frame on its way to the thread of the transaction's callback. The
+    //callback may wrap javascript, so the last reference to it has to be
+    //dropped over there and not on the I/O thread.
+    struct Delivery
+    {
+        QSharedPointer<TransactionCallback> cb;
+        PFrame f;
+        bool final;
+        void operator()() const
+        {
+            (*cb)(f, final);
+        }
+    };
+
+    //Holds the last reference to a callback on its way to its own thread
+    struct Release
+    {
+        QSharedPointer<TransactionCallback> cb;
+        void operator()() const
+        {
+        }
+    };
+
+    //Runs d on thread, or right here if there is none
+    void deliver(QThread *thread, Delivery d)
+    {
+        if (thread == nullptr)
+        {
+            d();
+            return;
+        }
+        ThreadDispatcher::forThread(thread)->post(std::move(d));
+    }
+
+    //Reconnection delays double from the first to the last, each picked at
+    //random from its upper half so restarted agents are not stampeded
+    const int RetryFirstMsecs = 100;
+    const int RetryMaxMsecs = 30000;
+
+    int retryDelay(int attempt)
+    {
+        int ceiling = RetryMaxMsecs;
+        if (attempt < 16)
+        {
+            ceiling = std::min(RetryMaxMsecs, RetryFirstMsecs << attempt);
+        }
+#if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
+        quint32 r = QRandomGenerator::global()->generate();
+#else
+        quint32 r = quint32(qrand());
+#endif
+        return ceiling / 2 + int(r % quint32(ceiling / 2 + 1));
+    }
+}
+
+void AgentConnection::initTimers()
+{
+    m_retryTimer = new QTimer(this);
+    m_retryTimer->setSingleShot(true);
+    connect(m_retryTimer, &QTimer::timeout, this, &AgentConnection::initSock);
+    m_heartbeatTimer = new QTimer(this);
+    connect(m_heartbeatTimer, &QTimer::timeout, this, &AgentConnection::onHeartbeat);
+    m_deadlineTimer = new QTimer(this);
+    m_deadlineTimer->setInterval(DeadlineTickMsecs);
+    connect(m_deadlineTimer, &QTimer::timeout, this, &AgentConnection::onDeadline);
+    m_clock.start();
+}
+
 void AgentConnection::onConnect()
 {
     qDebug() << "socket connected";
     if (!m_ragent) {
-        emit agentChanged(true, "");
+        linkUp();
     } //otherwise we do it later
 }
+
 void AgentConnection::onError()
 {
-    emit agentChanged(false, sock->errorString());
-    qFatal("some kind of socket error or something...");
-}
-void AgentConnection::readRO(QStringList &tokens)
-{
-    //tokens0 is 'ro'
-    Q_ASSERT(tokens.length() == 3);
-    int ronum = tokens[1].toInt();
-    int length = tokens[2].toInt();
-    //For now do not support >16MB
-    Q_ASSERT(length < 16*1024*1024);
-    char *dat = new char[length];
-    int readlen = sock->read(&dat[0],length);
-    //We should be fully buffered
-    Q_ASSERT(readlen == length);
-    RoutingObject *ro = new RoutingObject(ronum, dat, length);
-    curFrame->addRoutingObject(ro);
-    char eatline[2];
-    sock->read(&eatline[0],1);
-}
-void AgentConnection::readPO(QStringList &tokens)
-{
-    //tokens0 is 'po'
-    Q_ASSERT(tokens.length() == 3);
-    int ponum = tokens[1].split(':')[1].toInt();
-    int length = tokens[2].toInt();
-    //For now do not support >16MB
-    Q_ASSERT(length < 16*1024*1024);
-    char *dat = new char[length];
-    int readlen = sock->read(&dat[0],length);
-    //We should be fully buffered
-    Q_ASSERT(readlen == length);
-    PayloadObject *ro = PayloadObject::load(ponum, dat, length);
-    curFrame->addPayloadObject(ro);
-    char eatline[2];
-    sock->read(&eatline[0],1);
-}
-void AgentConnection::readKV(QStringList &tokens)
-{
-    //tokens0 is 'kv'
-    Q_ASSERT(tokens.length() == 3);
-    QString key = tokens[1];
-    int length = tokens[2].toInt();
-    //For now do not support >16MB
-    Q_ASSERT(length < 16*1024*1024);
-    char *dat = new char[length];
-    int readlen = sock->read(&dat[0],length);
-    //We should be fully buffered
-    Q_ASSERT(readlen == length);
-    Header *h = new Header(key,dat, length);
-    curFrame->addHeader(h);
-    char eatline[2];
-    sock->read(&eatline[0],1);
+    linkDown(sock->errorString());
+}
+
+void AgentConnection::linkUp()
+{
+    Q_ASSERT(QThread::currentThread() == this->m_thread);
+    m_up = true;
+    m_downAnnounced = false;
+    m_attempt = 0;
+    m_probing = false;
+    m_lastRx.start();
+    if (m_heartbeatInterval > 0)
+    {
+        m_heartbeatTimer->start(m_heartbeatInterval);
+    }
+    //The agent has forgotten who we are (if it ever knew), and everything
+    //held since the link went down was made as that entity
+    if (!m_entityFrame.isEmpty())
+    {
+        sock->write(m_entityFrame);
+        if (m_entitySeqno != 0)
+        {
+            m_written.insert(m_entitySeqno);
+            m_entitySeqno = 0;
+        }
+    }
+    foreach (const TxFrame &t, m_txFrames)
+    {
+        t.f->appendTo(m_txbuf);
+    }
+    flushTx();
+    emit agentChanged(true, "");
+    if (m_everUp)
+    {
+        {
+            QMutexLocker l(&m_statsLock);
+            m_stats.reconnects++;
+            m_stats.lastRecoveryMsecs = m_downSince.elapsed();
+            m_stats.totalDowntimeMsecs += m_stats.lastRecoveryMsecs;
+        }
+        emit reconnected();
+    }
+    m_everUp = true;
+}
+
+void AgentConnection::linkDown(QString why)
+{
+    Q_ASSERT(QThread::currentThread() == this->m_thread);
+    if (sock == nullptr)
+    {
+        //Already down, this is the old socket having its say
+        return;
+    }
+    qWarning() << "agent connection lost:" << why;
+    bool wasUp = m_up;
+    m_up = false;
+    m_heartbeatTimer->stop();
+    sock->disconnect(this);
+    sock->abort();
+    sock->deleteLater();
+    sock = nullptr;
+    m_parser.reset();
+    have_received_helo = false;
+    m_ragent_handshake = 0;
+    //What is still in m_txFrames never left, it goes out once the link is
+    //back (the bytes are made again then)
+    m_txbuf.resize(0);
+    m_flushQueued = false;
+
+    //Nothing will answer what was written, so whatever waits on that fails
+    //now. Transactions that are held keep waiting, their deadlines bound
+    //how long
+    QList<QPair<quint32, TransactionTable::Entry>> pending;
+    m_transactions.takeAll(&pending);
+    int failed = 0;
+    for (auto i = pending.begin(); i != pending.end(); i++)
+    {
+        if (!m_written.contains(i->first))
+        {
+            m_transactions.insert(i->first, i->second);
+            continue;
+        }
+        m_deadlines.cancel(i->first);
+        if (i->second.persistent)
+        {
+            if (i->second.thread != nullptr)
+            {
+                Release r;
+                r.cb.swap(i->second.cb);
+                ThreadDispatcher::forThread(i->second.thread)->post(std::move(r));
+            }
+            continue;
+        }
+        fail(i->first, i->second, QStringLiteral("agent connection lost: %1").arg(why));
+        failed++;
+    }
+    m_written.clear();
+    if (m_deadlines.isEmpty())
+    {
+        m_deadlineTimer->stop();
+    }
+
+    {
+        QMutexLocker l(&m_statsLock);
+        m_stats.failedTransactions += failed;
+        if (wasUp)
+        {
+            m_stats.disconnects++;
+        }
+    }
+    if (wasUp)
+    {
+        m_downSince.start();
+    }
+    if (!m_downAnnounced)
+    {
+        m_downAnnounced = true;
+        emit agentChanged(false, why);
+    }
+    scheduleReconnect();
+}
+
+void AgentConnection::scheduleReconnect()
+{
+    m_retryTimer->start(retryDelay(m_attempt++));
+}
+
+void AgentConnection::onHeartbeat()
+{
+    Q_ASSERT(QThread::currentThread() == this->m_thread);
+    if (!m_up || m_lastRx.elapsed() < m_heartbeatInterval)
+    {
+        return;
+    }
+    if (m_probing)
+    {
+        //Silent for a whole interval after being asked something
+        {
+            QMutexLocker l(&m_statsLock);
+            m_stats.heartbeatTimeouts++;
+        }
+        linkDown(QStringLiteral("agent stopped responding"));
+        return;
+    }
+    //Any request gets a response, this one is cheap for the agent. Nobody
+    //waits on it, it is the arriving bytes that count
+    m_probing = true;
+    m_lastRx.start();
+    doTransact(newFrame(Frame::BC_PARAMS), false);
+}
+
+void AgentConnection::setHeartbeat(int msecs)
+{
+    ThreadDispatcher::forThread(m_thread)->post([this, msecs]
+    {
+        m_heartbeatInterval = qMax(msecs, 0);
+        if (m_heartbeatInterval == 0)
+        {
+            m_heartbeatTimer->stop();
+        }
+        else if (m_up)
+        {
+            m_heartbeatTimer->start(m_heartbeatInterval);
+        }
+    });
+}
+
+void AgentConnection::setRequestTimeout(int msecs)
+{
+    //Read as each transaction starts, the ones already waiting keep theirs
+    m_requestTimeout.storeRelease(qMax(msecs, 0));
+}
+
+void AgentConnection::arm(quint32 seqno, int timeout)
+{
+    if (m_deadlines.isEmpty())
+    {
+        //The wheel does not follow the clock while it has nothing to do
+        QList<quint32> none;
+        m_deadlines.advance(m_clock.elapsed(), &none);
+        m_deadlineTimer->start();
+    }
+    m_deadlines.schedule(seqno, m_clock.elapsed() + timeout);
+}
+
+void AgentConnection::onDeadline()
+{
+    Q_ASSERT(QThread::currentThread() == this->m_thread);
+    QList<quint32> expired;
+    m_deadlines.advance(m_clock.elapsed(), &expired);
+    if (m_deadlines.isEmpty())
+    {
+        m_deadlineTimer->stop();
+    }
+    int timedOut = 0;
+    foreach (quint32 seqno, expired)
+    {
+        TransactionTable::Entry e;
+        if (!m_transactions.find(seqno, true, &e))
+        {
+            continue;
+        }
+        //Whatever the agent sends for it from now on is too late. One that
+        //was never answered is left to the table, as the parser would have
+        //to remember it until the link goes down
+        if (e.answered)
+        {
+            m_parser.ignore(seqno);
+        }
+        m_written.remove(seqno);
+        unhold(seqno);
+        fail(seqno, e, QStringLiteral("no response from agent within %1 ms").arg(e.timeout));
+        timedOut++;
+    }
+    if (timedOut > 0)
+    {
+        QMutexLocker l(&m_statsLock);
+        m_stats.failedTransactions += timedOut;
+        m_stats.timedOutTransactions += timedOut;
+    }
+}
+
+void AgentConnection::unhold(quint32 seqno)
+{
+    if (m_up)
+    {
+        //Its bytes are in m_txbuf already
+        return;
+    }
+    if (seqno == m_entitySeqno)
+    {
+        //The sete itself still goes out, the agent needs it for the rest
+        m_entitySeqno = 0;
+        return;
+    }
+    for (auto i = m_txFrames.begin(); i != m_txFrames.end(); i++)
+    {
+        if (i->tracked && i->f->seqno() == seqno)
+        {
+            m_txFrames.erase(i);
+            return;
+        }
+    }
+}
+
+void AgentConnection::fail(quint32 seqno, TransactionTable::Entry &e, QString reason)
+{
+    PFrame f = newFrame(Frame::RESPONSE, seqno);
+    f->addHeader("status", "error");
+    f->addHeader("reason", reason);
+    f->addHeader("finished", "true");
+    Delivery d;
+    d.cb.swap(e.cb);
+    d.f = f;
+    d.final = true;
+    deliver(e.thread, std::move(d));
+}
+
+ConnectionStats AgentConnection::stats()
+{
+    QMutexLocker l(&m_statsLock);
+    return m_stats;
 }
 void AgentConnection::onArrivedData()
 {
+    m_lastRx.start();
+    m_probing = false;
     if (m_ragent && m_ragent_handshake==0)
     {
         if (sock->bytesAvailable() < 128)
@@ -231,64 +629,31 @@ void AgentConnection::onArrivedData()
             qFatal("remote dislikes us");
         }
         m_ragent_handshake=2;
-        emit agentChanged(true, "");
         qDebug() << "finished remote agent handshake";
+        linkUp();
     }
-    if (curFrame.isNull())
-    {
-        //New frame, read the header
-        if (sock->bytesAvailable() < 27)
-            return; //Wait until we have the full header
-        char hdr[28];
-        qint64 l = sock->read(hdr,27);
-        Q_ASSERT(l==27);
-        //Remember header is
-        //    4          15         26
-        //CMMD 10DIGITLEN 10DIGITSEQ\n
-        hdr[4]=0;
-        hdr[15]=0;
-        hdr[26]=0;//Kill the \n too
-        int length = QString(&hdr[5]).toInt(); //not currently used
-        int seq = QString(&hdr[16]).toInt();
-        curFrame = newFrame(&hdr[0], seq);
-        waitingFor = length;
-    }
-    //We have a frame, we are loading parts of it
-    if (sock->bytesAvailable() < waitingFor)
-        return; //wait until it is fully loaded
-
-    //All of this we can now do without blocking as teh data is buffered
-    char linebuf[256];
-    while(1) {
-        auto linelen = sock->readLine(linebuf, 256);
-        Q_ASSERT(linelen < 255);
-        Q_ASSERT(linelen > 0);
-        linebuf[linelen-1] = 0; //kill the newline
-        QString line(linebuf);
-        QStringList tokens = line.split(' ');
-        if (tokens[0] == "kv") {
-            readKV(tokens);
-        }else if (tokens[0] == "po") {
-            readPO(tokens);
-        }else if (tokens[0] == "ro") {
-            readRO(tokens);
-        }else if (tokens[0] == "end") {
-            //This frame is finished
-            auto nf = curFrame;
-            curFrame.reset();
-            invokeOnThread(QCoreApplication::instance()->thread(),
-                           std::function<void (PFrame)>([this](PFrame f)
-                           {
-                               this->onArrivedFrame(f);
-                           }), nf);
-            QMetaObject::invokeMethod(this,"onArrivedData",Qt::QueuedConnection);
+    m_parser.fill(sock);
+    forever
+    {
+        PFrame nf;
+        switch (m_parser.next(this, nf))
+        {
+        case FrameParser::NeedMore:
+            return;
+        case FrameParser::Malformed:
+            //There is no finding the next frame, so start over
+            linkDown("malformed frame from agent");
             return;
+        case FrameParser::FrameReady:
+            onArrivedFrame(nf);
+            break;
         }
     }
 }
 
 void AgentConnection::initSock()
 {
+    m_ragent_handshake = 0;
     if (!m_ragent)
     {
         sock = new QTcpSocket(this);
@@ -331,9 +696,56 @@ void AgentConnection::onSslErrors(QList<QSslError> errs)
     }
 }
 
+void TransactionTable::insert(quint32 seqno, const Entry &e)
+{
+    Shard &sh = m_shards[seqno % NumShards];
+    QMutexLocker l(&sh.lock);
+    sh.entries.insert(seqno, e);
+}
+
+void TransactionTable::takeAll(QList<QPair<quint32, Entry>> *out)
+{
+    for (int i = 0; i < NumShards; i++)
+    {
+        Shard &sh = m_shards[i];
+        QMutexLocker l(&sh.lock);
+        for (auto it = sh.entries.begin(); it != sh.entries.end(); it++)
+        {
+            out->append(qMakePair(it.key(), it.value()));
+        }
+        sh.entries.clear();
+    }
+}
+
+bool TransactionTable::find(quint32 seqno, bool take, Entry *out)
+{
+    Shard &sh = m_shards[seqno % NumShards];
+    QMutexLocker l(&sh.lock);
+    auto it = sh.entries.find(seqno);
+    if (it == sh.entries.end())
+        return false;
+    out->thread = it->thread;
+    out->persistent = it->persistent;
+    out->timeout = it->timeout;
+    out->openEnded = it->openEnded;
+    out->answered = it->answered;
+    if (take)
+    {
+        //Swap rather than copy so the caller ends up holding the only reference
+        out->cb.swap(it->cb);
+        sh.entries.erase(it);
+    }
+    else
+    {
+        it->answered = true;
+        out->cb = it->cb;
+    }
+    return true;
+}
+
 void AgentConnection::onArrivedFrame(PFrame f)
 {
-    Q_ASSERT(QThread::currentThread() == QCoreApplication::instance()->thread());
+    Q_ASSERT(QThread::currentThread() == this->m_thread);
 
     //We need to determine which transaction this belongs to, and forward the frame there.
     if (f->isType(Frame::HELLO))
@@ -343,162 +755,535 @@ void AgentConnection::onArrivedFrame(PFrame f)
         return;
     }
 
-    Q_ASSERT(outstanding.contains(f->seqno()));
     bool present;
-    bool final = f->getHeaderBool("finished", &present);
+    bool final = f->getHeaderBool(Header::KeyFinished, &present);
     Q_ASSERT_X(present, "frame decode", "finished kv missing");
-    outstanding.value(f->seqno())(f, final);
-    if (final) {
-        outstanding.remove(f->seqno());
+    TransactionTable::Entry e;
+    if (!m_transactions.find(f->seqno(), final, &e))
+    {
+        //Nobody is waiting for this (any more)
+        return;
+    }
+    if (final)
+    {
+        m_written.remove(f->seqno());
+    }
+    if (e.timeout > 0)
+    {
+        //Once it has answered, an open ended transaction may take as long
+        //as it likes to say anything else. Anything else has the same time
+        //again for its next frame
+        if (final || e.openEnded)
+        {
+            m_deadlines.cancel(f->seqno());
+        }
+        else
+        {
+            arm(f->seqno(), e.timeout);
+        }
     }
+    Delivery d;
+    d.cb.swap(e.cb);
+    d.f = f;
+    d.final = final;
+    deliver(e.thread, std::move(d));
 }
-void AgentConnection::transact(PFrame f, function<void (PFrame, bool)> cb)
+
+void AgentConnection::transact(QObject *to, PFrame f, function<void (PFrame, bool)> cb, bool persistent)
 {
-    Q_ASSERT(QThread::currentThread() == QCoreApplication::instance()->thread());
+    //Responses go straight from the I/O thread to the thread that 'to'
+    //lives in (probably the GUI thread).
+    transactOn(to->thread(), f, cb, persistent);
+}
 
-    outstanding[f->seqno()] = cb;
+void AgentConnection::transactOn(QThread *thread, PFrame f, function<void (PFrame, bool)> cb, bool persistent,
+                                 int timeoutMsecs)
+{
+    TransactionTable::Entry e;
+    e.thread = thread;
+    e.persistent = persistent;
+    e.timeout = timeoutMsecs < 0 ? m_requestTimeout.loadAcquire() : timeoutMsecs;
+    e.openEnded = persistent || f->isType(Frame::SUBSCRIBE) || f->isType(Frame::TAP_SUBSCRIBE) ||
+                  f->isType(Frame::SUBSCRIBE_VIEW);
+    e.cb = QSharedPointer<TransactionCallback>(new TransactionCallback(cb));
+    m_transactions.insert(f->seqno(), e);
 
-    //We want to move this to a different thread if we are not on the agent's thread
-    QMetaObject::invokeMethod(this, "doTransact", Q_ARG(PFrame, f));
+    int timeout = e.timeout;
+    ThreadDispatcher::forThread(m_thread)->post([this, f, timeout]
+    {
+        if (timeout > 0)
+        {
+            this->arm(f->seqno(), timeout);
+        }
+        this->doTransact(f, true);
+    });
 }
 
-void AgentConnection::transact(QObject *to, PFrame f, function<void (PFrame, bool)> cb)
+void AgentConnection::cancel(quint32 seqno)
 {
-    //Basically the callback to transact will wrap the real callback, and move it
-    //to the thread that 'to' lives in (probably the GUI thread).
-    auto safecb = [=](PFrame f, bool fin)
+    ThreadDispatcher::forThread(m_thread)->post([this, seqno]
     {
-        invokeOnThread(to->thread(), cb, f, fin);
-    };
+        TransactionTable::Entry e;
+        if (!m_transactions.find(seqno, true, &e))
+        {
+            //Finished already
+            return;
+        }
+        if (e.answered)
+        {
+            m_parser.ignore(seqno);
+        }
+        m_deadlines.cancel(seqno);
+        m_written.remove(seqno);
+        unhold(seqno);
+        if (e.thread != nullptr)
+        {
+            Release r;
+            r.cb.swap(e.cb);
+            ThreadDispatcher::forThread(e.thread)->post(std::move(r));
+        }
+    });
+}
 
-    invokeOnThread(QCoreApplication::instance()->thread(),
-                   std::function<void()>([=]()
-                   {
-                       this->transact(f, safecb);
-                   }));
+void AgentConnection::send(PFrame f)
+{
+    ThreadDispatcher::forThread(m_thread)->post([this, f]
+    {
+        this->doTransact(f, false);
+    });
 }
 
-void AgentConnection::doTransact(PFrame f)
+void AgentConnection::doTransact(PFrame f, bool tracked)
 {
     Q_ASSERT(QThread::currentThread() == this->m_thread);
     //Now that we know we are on the right thread, there is no need to lock on the socket access
-    f->writeTo(sock);
+    if (f->isType(Frame::SET_ENTITY))
+    {
+        m_entityFrame.resize(0);
+        f->appendTo(m_entityFrame);
+        if (!m_up)
+        {
+            //linkUp sends it ahead of anything held
+            m_entitySeqno = tracked ? f->seqno() : 0;
+            return;
+        }
+        //Written at once, as held in m_txFrames too it would go out twice
+        m_txFrames.append(TxFrame{f, tracked});
+        f->appendTo(m_txbuf);
+        flushTx();
+        return;
+    }
+    m_txFrames.append(TxFrame{f, tracked});
+    if (!m_up)
+    {
+        //Held until the link is back
+        return;
+    }
+    f->appendTo(m_txbuf);
+
+    //When the link is idle a lone frame goes out straight away. Otherwise
+    //frames are coalesced and written once per event loop turn, or as soon
+    //as the batch is big enough that holding it back gains nothing.
+    bool idle = !m_flushQueued && sock->bytesToWrite() == 0;
+    if (idle || m_txbuf.size() >= TxFlushThreshold)
+    {
+        flushTx();
+        return;
+    }
+    if (!m_flushQueued)
+    {
+        m_flushQueued = true;
+        QMetaObject::invokeMethod(this, "flushTx", Qt::QueuedConnection);
+    }
 }
-void Frame::writeTo(QIODevice *o)
+
+void AgentConnection::flushTx()
+{
+    Q_ASSERT(QThread::currentThread() == this->m_thread);
+    m_flushQueued = false;
+    if (!m_up)
+        return;
+    foreach (const TxFrame &t, m_txFrames)
+    {
+        //Nothing would take a frame with no table entry out of m_written
+        if (t.tracked)
+        {
+            m_written.insert(t.f->seqno());
+        }
+    }
+    m_txFrames.clear();
+    if (m_txbuf.isEmpty())
+        return;
+    sock->write(m_txbuf);
+    //The buffer has reserved capacity, so this keeps it for the next batch
+    m_txbuf.resize(0);
+}
+namespace
+{
+    int decimalLength(qint64 v)
+    {
+        int n = 1;
+        if (v < 0)
+        {
+            n++;
+            v = -v;
+        }
+        while (v >= 10)
+        {
+            v /= 10;
+            n++;
+        }
+        return n;
+    }
+
+    char* writeDecimal(char *p, qint64 v, int width = 0)
+    {
+        if (v < 0)
+        {
+            *p++ = '-';
+            v = -v;
+        }
+        char tmp[20];
+        int n = 0;
+        do
+        {
+            tmp[n++] = char('0' + v % 10);
+            v /= 10;
+        } while (v != 0);
+        while (width-- > n)
+            *p++ = '0';
+        while (n > 0)
+            *p++ = tmp[--n];
+        return p;
+    }
+
+    char* writeObject(char *p, const char *prefix, int prefixlen, const char *data, int length)
+    {
+        memcpy(p, prefix, prefixlen);
+        p += prefixlen;
+        *p++ = ' ';
+        p = writeDecimal(p, length);
+        *p++ = '\n';
+        memcpy(p, data, length);
+        p += length;
+        *p++ = '\n';
+        return p;
+    }
+}
+
+int Frame::encodedLength()
+{
+    //CMMD 10DIGITLEN 10DIGITSEQ\n ... end\n
+    int n = 27 + 4;
+    foreach(auto kv, headers)
+    {
+        //kv key len\n<data>\n
+        n += 3 + kv->key().length() + 1 + decimalLength(kv->length()) + 1 + kv->length() + 1;
+    }
+    foreach(auto ro, ros)
+    {
+        //ro num len\n<data>\n
+        n += 3 + decimalLength(ro->ronum()) + 1 + decimalLength(ro->length()) + 1 + ro->length() + 1;
+    }
+    foreach(auto po, pos)
+    {
+        //po :num len\n<data>\n
+        n += 4 + decimalLength(po->ponum()) + 1 + decimalLength(po->length()) + 1 + po->length() + 1;
+    }
+    return n;
+}
+
+void Frame::appendTo(QByteArray &out)
 {
+    int start = out.size();
+    int n = encodedLength();
+    out.resize(start + n);
+    char *p = out.data() + start;
+
     //We omit frame length, BW server can handle that
-    QString hdr = QString("%1 %2 %3\n").arg(m_type,4).arg(0,10,10,QChar('0')).arg(m_seqno,10,10,QChar('0'));
-    o->write(hdr.toLatin1());
+    memcpy(p, m_type, 4);
+    p[4] = ' ';
+    p = writeDecimal(p + 5, 0, 10);
+    *p++ = ' ';
+    p = writeDecimal(p, m_seqno, 10);
+    *p++ = '\n';
+
+    char line[64];
     foreach(auto kv, headers)
     {
-        QString hdr = QString("kv %1 %2\n").arg(kv->key()).arg(kv->length());
-        o->write(hdr.toLatin1());
-        o->write(kv->content(), kv->length());
-        o->write("\n",1);
+        const QString &key = kv->key();
+        memcpy(p, "kv ", 3);
+        p += 3;
+        const QChar *k = key.constData();
+        for (int i = 0; i < key.length(); i++)
+            *p++ = k[i].toLatin1();
+        p = writeObject(p, "", 0, kv->content(), kv->length());
     }
     foreach(auto ro, ros)
     {
-        QString hdr = QString("ro %1 %2\n").arg(ro->ronum()).arg(ro->length());
-        o->write(hdr.toLatin1());
-        o->write(ro->content(), ro->length());
-        o->write("\n",1);
+        memcpy(line, "ro ", 3);
+        char *e = writeDecimal(line + 3, ro->ronum());
+        p = writeObject(p, line, e - line, ro->content(), ro->length());
     }
     foreach(auto po, pos)
     {
-        QString hdr = QString("po :%1 %2\n").arg(po->ponum()).arg(po->length());
-        o->write(hdr.toLatin1());
-        o->write(po->content(),po->length());
-        o->write("\n",1);
+        memcpy(line, "po :", 4);
+        char *e = writeDecimal(line + 4, po->ponum());
+        p = writeObject(p, line, e - line, po->content(), po->length());
     }
-    o->write("end\n",4);
+    memcpy(p, "end\n", 4);
+    p += 4;
+    Q_ASSERT(p == out.data() + out.size());
 }
 
-//Returns false if not there
-bool Frame::getHeaderBool(QString key, bool *valid)
+void Frame::writeTo(QIODevice *o)
+{
+    QByteArray buf;
+    buf.reserve(encodedLength());
+    appendTo(buf);
+    o->write(buf);
+}
+
+Header* Frame::header(const QString &key)
 {
+    Header::Key k = Header::lookupKey(key);
+    if (k != Header::KeyUnknown)
+    {
+        return header(k);
+    }
     foreach(auto h, headers)
     {
         if (h->key() == key)
         {
-            if (valid != NULL)
-                *valid = true;
-            return h->asBool();
+            return h;
         }
     }
+    return nullptr;
+}
+
+//Returns false if not there
+bool Frame::getHeaderBool(QString key, bool *valid)
+{
+    Header *h = header(key);
+    if (valid != NULL)
+        *valid = h != nullptr;
+    return h != nullptr ? h->asBool() : false;
+}
+
+bool Frame::getHeaderBool(Header::Key key, bool *valid)
+{
+    Header *h = header(key);
     if (valid != NULL)
-        *valid = false;
-    return false;
+        *valid = h != nullptr;
+    return h != nullptr ? h->asBool() : false;
 }
 
 QByteArray Frame::getHeaderB(QString key, bool* valid)
 {
-    foreach(auto h, headers)
+    Header *h = header(key);
+    if (valid != NULL)
+        *valid = h != nullptr;
+    return h != nullptr ? h->asByteArray() : QByteArray();
+}
+
+QByteArray Frame::getHeaderB(Header::Key key, bool* valid)
+{
+    Header *h = header(key);
+    if (valid != NULL)
+        *valid = h != nullptr;
+    return h != nullptr ? h->asByteArray() : QByteArray();
+}
+
+//Returns "" if not there
+QString Frame::getHeaderS(QString key, bool *valid)
+{
+    Header *h = header(key);
+    if (valid != NULL)
+        *valid = h != nullptr;
+    return h != nullptr ? h->asString() : QString("");
+}
+
+QString Frame::getHeaderS(Header::Key key, bool *valid)
+{
+    Header *h = header(key);
+    if (valid != NULL)
+        *valid = h != nullptr;
+    return h != nullptr ? h->asString() : QString("");
+}
+
+//Returns -1 if not there
+int Frame::getHeaderI(QString key, bool *valid)
+{
+    Header *h = header(key);
+    if (valid != NULL)
+        *valid = h != nullptr;
+    return h != nullptr ? h->asInt() : -1;
+}
+
+int Frame::getHeaderI(Header::Key key, bool *valid)
+{
+    Header *h = header(key);
+    if (valid != NULL)
+        *valid = h != nullptr;
+    return h != nullptr ? h->asInt() : -1;
+}
+
+namespace
+{
+    //Must match the order of Header::Key
+    const char* const KnownKeys[Header::NumKnownKeys] =
     {
-        if (h->key() == key)
+        "finished",
+        "status",
+        "reason",
+        "uri",
+        "from",
+        "handle",
+        "hash",
+        "vk",
+        "value",
+        "id",
+        "to",
+        "validity",
+        "permissions",
+        "child"
+    };
+    int KnownKeyLengths[Header::NumKnownKeys];
+
+    struct KnownKeyNames
+    {
+        KnownKeyNames()
         {
-            if (valid != NULL)
-                *valid = true;
-            return h->asByteArray();
+            for (int i = 0; i < Header::NumKnownKeys; i++)
+            {
+                KnownKeyLengths[i] = int(strlen(KnownKeys[i]));
+                names[i] = QString::fromLatin1(KnownKeys[i]);
+            }
         }
+        QString names[Header::NumKnownKeys];
+    };
+
+    const KnownKeyNames& knownKeyNames()
+    {
+        static KnownKeyNames n;
+        return n;
     }
-    if (valid != NULL)
-        *valid = false;
-    return QByteArray();
 }
 
-//Returns "" if not there
-QString Frame::getHeaderS(QString key, bool *valid)
+Header::Key Header::lookupKey(const char *key, int keylen)
 {
-    foreach(auto h, headers)
+    knownKeyNames();
+    for (int i = 0; i < NumKnownKeys; i++)
     {
-        if (h->key() == key)
+        if (KnownKeyLengths[i] == keylen && memcmp(KnownKeys[i], key, keylen) == 0)
         {
-            if (valid != NULL)
-                *valid = true;
-            return h->asString();
+            return Key(i);
         }
     }
-    if (valid != NULL)
-        *valid = false;
-    return QString("");
+    return KeyUnknown;
 }
 
-//Returns -1 if not there
-int Frame::getHeaderI(QString key, bool *valid)
+Header::Key Header::lookupKey(const QString &key)
 {
-    foreach(auto h, headers)
+    knownKeyNames();
+    for (int i = 0; i < NumKnownKeys; i++)
     {
-        if (h->key() == key)
+        if (KnownKeyLengths[i] == key.length() && key == QLatin1String(KnownKeys[i]))
         {
-            if (valid != NULL)
-                *valid = true;
-            return h->asInt();
+            return Key(i);
         }
     }
-    if (valid != NULL)
-        *valid = false;
-    return -1;
+    return KeyUnknown;
+}
+
+const QString& Header::keyName(Key k)
+{
+    return knownKeyNames().names[k];
 }
 
-bool Header::asBool()
+void Header::decode()
 {
-    if (asString().toLower() == "true")
+    //Same as asString().toLower() == "true", without the strings
+    m_bool = m_length == 4 &&
+            (m_data[0] | 0x20) == 't' && (m_data[1] | 0x20) == 'r' &&
+            (m_data[2] | 0x20) == 'u' && (m_data[3] | 0x20) == 'e';
+
+    //Same as asString().toInt(): 0 unless the whole value is a number that fits
+    m_int = 0;
+    int i = 0;
+    while (i < m_length && m_data[i] == ' ')
+        i++;
+    int end = m_length;
+    while (end > i && m_data[end - 1] == ' ')
+        end--;
+    bool neg = false;
+    if (i < end && (m_data[i] == '-' || m_data[i] == '+'))
     {
-        return true;
+        neg = m_data[i] == '-';
+        i++;
     }
-    return false;
+    if (i == end)
+        return;
+    qint64 v = 0;
+    for (; i < end; i++)
+    {
+        unsigned d = (unsigned char)(m_data[i]) - '0';
+        if (d > 9)
+            return;
+        v = v*10 + d;
+        if (v > qint64(INT_MAX) + 1)
+            return;
+    }
+    if (neg)
+        v = -v;
+    if (v < INT_MIN || v > INT_MAX)
+        return;
+    m_int = int(v);
 }
-int Header::asInt()
+
+bool Header::equals(const char *val)
 {
-    return asString().toInt();
+    int len = int(strlen(val));
+    return len == m_length && memcmp(val, m_data, len) == 0;
 }
 
 QString Header::asString()
 {
-    return QString::fromUtf8(m_data, m_length);
+    return MsgPack::fromUtf8(m_data, m_length);
 }
 
 QByteArray Header::asByteArray()
 {
     return QByteArray(m_data, m_length);
 }
+
+void TransactionHandle::started(AgentConnection *conn, quint32 seqno)
+{
+    QMutexLocker l(&m_lock);
+    m_conn = conn;
+    m_seqno = seqno;
+    if (m_cancelled)
+    {
+        conn->cancel(seqno);
+    }
+}
+
+void TransactionHandle::cancel()
+{
+    QMutexLocker l(&m_lock);
+    if (m_cancelled)
+    {
+        return;
+    }
+    m_cancelled = true;
+    if (!m_conn.isNull())
+    {
+        m_conn->cancel(m_seqno);
+    }
+}
+
+bool TransactionHandle::isCancelled()
+{
+    QMutexLocker l(&m_lock);
+    return m_cancelled;
+}
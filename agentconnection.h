@@ -6,17 +6,31 @@
 #include <QDebug>
 #include <QSharedPointer>
 #include <QTcpSocket>
+#include <QElapsedTimer>
 #include <QThread>
 #include <string>
 #include <functional>
+#include <new>
+#include <cstddef>
+#include <utility>
 #include <QJSValue>
 #include <QJSEngine>
 #include <QSslError>
+#include <QMutex>
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QSet>
+#include <QPointer>
+#include "frameparser.h"
+#include "timerwheel.h"
+#include "crypto.h"
 using std::function;
 
 QT_FORWARD_DECLARE_CLASS(PayloadObject)
 QT_FORWARD_DECLARE_CLASS(Message)
 QT_FORWARD_DECLARE_CLASS(AgentConnection)
+QT_FORWARD_DECLARE_CLASS(QTimer)
 
 class RoutingObject : public QObject
 {
@@ -27,13 +41,15 @@ class RoutingObject : public QObject
 public:
     RoutingObject(QObject* parent = nullptr)
         : QObject(parent), isEntity(false), isDOT(false), offset(0), m_ronum(0),
-          m_data(nullptr), m_length(0) {}
-    RoutingObject(int ronum, const char *data, int length, QObject* parent = nullptr)
+          m_data(nullptr), m_length(0), m_owned(true), m_signature(0) {}
+    //If owned is false, data belongs to someone else (e.g. a received frame)
+    RoutingObject(int ronum, const char *data, int length, QObject* parent = nullptr, bool owned = true)
         : QObject(parent), isEntity(false), isDOT(false), offset(0), m_ronum(ronum),
-          m_data(data), m_length(length) {}
+          m_data(data), m_length(length), m_owned(owned), m_signature(0) {}
     ~RoutingObject()
     {
-        delete[] m_data;
+        if (m_owned)
+            delete[] m_data;
     }
     int ronum()
     {
@@ -50,6 +66,14 @@ public:
         return m_length - offset;
     }
 
+    //Entities, DOTs and revocations end in a signature over everything
+    //before it, made by the key they start with. Fills in item for those
+    //and returns false for anything else.
+    bool verifyItem(VerifyItem *item);
+    //Whether that signature is good, checked on first use only. False for
+    //objects without one
+    bool signatureValid();
+
     bool isEntity;
     bool isDOT;
 
@@ -60,6 +84,9 @@ private:
     int m_ronum;
     const char* m_data;
     int m_length;
+    bool m_owned;
+    //0 until checked, then 1 if the signature is good and 2 if not
+    QAtomicInt m_signature;
 };
 
 class Entity : public RoutingObject
@@ -67,10 +94,12 @@ class Entity : public RoutingObject
     Q_OBJECT
 
 public:
-    Entity(QObject* parent = nullptr) : RoutingObject(parent) {};
+    Entity(QObject* parent = nullptr) : RoutingObject(parent), signedLength(0) {};
     Entity(int ronum, const char* data, int length, QObject* parent = nullptr);
 
     QByteArray getSigningBlob();
+    //Checks the entity's signature over itself
+    bool verify();
     QByteArray vk;
     QByteArray sk;
 private:
@@ -80,29 +109,75 @@ private:
     QList<QByteArray> revokers;
     QString contact;
     QString comment;
+    int signedLength;
 };
 
 class Header
 {
 public:
-    Header(QString key, char *data, int length) : m_key(key), m_data(data), m_length(length) {}
+    //Keys that frames are routinely searched for. Frames index these as
+    //headers are added, and Header interns their names.
+    enum Key
+    {
+        KeyUnknown = -1,
+        KeyFinished = 0,
+        KeyStatus,
+        KeyReason,
+        KeyURI,
+        KeyFrom,
+        KeyHandle,
+        KeyHash,
+        KeyVK,
+        KeyValue,
+        KeyID,
+        KeyTo,
+        KeyValidity,
+        KeyPermissions,
+        KeyChild,
+        NumKnownKeys
+    };
+
+    //If owned is false, data belongs to someone else (e.g. a received frame)
+    Header(QString key, const char *data, int length, bool owned = true)
+        : m_key(key), m_data(data), m_length(length), m_owned(owned)
+    {
+        m_known = lookupKey(m_key);
+        decode();
+    }
+    //As above, with the key given as latin1 bytes. Well known keys are not copied
+    Header(const char *key, int keylen, const char *data, int length, bool owned = true)
+        : m_data(data), m_length(length), m_owned(owned)
+    {
+        m_known = lookupKey(key, keylen);
+        m_key = m_known == KeyUnknown ? QString::fromLatin1(key, keylen) : keyName(m_known);
+        decode();
+    }
     Header(QString key, QString val)
     {
         m_key = key;
+        m_known = lookupKey(m_key);
 
         QByteArray utf8 = val.toUtf8();
-        m_data = new char[utf8.length()];
+        char *dat = new char[utf8.length()];
         m_length = utf8.length();
-        memcpy(m_data,utf8.data(), m_length);
+        memcpy(dat,utf8.data(), m_length);
+        m_data = dat;
+        m_owned = true;
+        decode();
     }
     ~Header()
     {
-        delete [] m_data;
+        if (m_owned)
+            delete [] m_data;
     }
     const QString& key()
     {
         return m_key;
     }
+    Key knownKey()
+    {
+        return m_known;
+    }
     const char* content ()
     {
         return m_data;
@@ -110,14 +185,32 @@ public:
     int length() {
         return m_length;
     }
-    bool asBool();
-    int asInt();
+    bool asBool()
+    {
+        return m_bool;
+    }
+    int asInt()
+    {
+        return m_int;
+    }
     QString asString();
     QByteArray asByteArray();
+    //Byte comparison against an ASCII literal
+    bool equals(const char *val);
+
+    static Key lookupKey(const char *key, int keylen);
+    static Key lookupKey(const QString &key);
+    static const QString& keyName(Key k);
 private:
+    //Decodes the typed values once, so asking for them is free
+    void decode();
     QString m_key;
-    char* m_data;
+    Key m_known;
+    const char* m_data;
     int m_length;
+    bool m_owned;
+    bool m_bool;
+    int m_int;
 };
 
 Q_DECLARE_METATYPE(RoutingObject*)
@@ -253,21 +346,59 @@ public:
     constexpr static const char* RESULT   = "rslt";
 
     Frame(AgentConnection *agent, const char* type, quint32 seqno)
-        :agent(agent), m_seqno(seqno)
+        :agent(agent), m_seqno(seqno), m_arena(nullptr), m_arenaSize(0), m_arenaUsed(0)
     {
         strncpy(&m_type[0],type,4);
         m_type[4] = 0;
+        for (int i = 0; i < Header::NumKnownKeys; i++)
+        {
+            m_index[i] = -1;
+        }
         pos = QList<PayloadObject*>();
         headers = QList<Header*>();
         ros = QList<RoutingObject*>();
     }
     ~Frame();
 
+    //Allocates the frame and arenaSize bytes of storage for its objects in
+    //one block, which is freed in one go with the last reference
+    static QSharedPointer<Frame> createWithArena(AgentConnection *agent, const char* type, quint32 seqno, int arenaSize);
+    //Arena space needed for one object of type T
+    template <typename T> static int arenaSizeOf()
+    {
+        return int(alignUp(sizeof(T)));
+    }
+    //Constructs a T in the frame's arena, or on the heap once the arena is used up.
+    //The frame destroys it either way once it has been added.
+    template <typename T, typename ...A> T* make(A&&... args)
+    {
+        size_t sz = alignUp(sizeof(T));
+        if (m_arenaUsed + sz <= m_arenaSize)
+        {
+            void *mem = m_arena + m_arenaUsed;
+            m_arenaUsed += sz;
+            return new (mem) T(std::forward<A>(args)...);
+        }
+        return new T(std::forward<A>(args)...);
+    }
+    void reserveObjects(int nheaders, int npos, int nros)
+    {
+        headers.reserve(nheaders);
+        pos.reserve(npos);
+        ros.reserve(nros);
+    }
+
     quint32 seqno()
     {
         return m_seqno;
     }
 
+    //The connection the frame was made for
+    AgentConnection *connection()
+    {
+        return agent;
+    }
+
     bool isType(const char* type)
     {
         return strcmp(m_type, type) == 0;
@@ -277,26 +408,37 @@ public:
         return &m_type[0];
     }
 
+    //The first header with the given key, or nullptr
+    Header* header(Header::Key key)
+    {
+        int idx = m_index[key];
+        return idx < 0 ? nullptr : headers.at(idx);
+    }
+    Header* header(const QString &key);
+
     //Returns false if not there
     bool getHeaderBool(QString key, bool *valid = nullptr);
+    bool getHeaderBool(Header::Key key, bool *valid = nullptr);
     //Returns empty array if not there
     QByteArray getHeaderB(QString key, bool* valid = nullptr);
+    QByteArray getHeaderB(Header::Key key, bool* valid = nullptr);
     //Returns "" if not there
     QString getHeaderS(QString key, bool *valid = nullptr);
+    QString getHeaderS(Header::Key key, bool *valid = nullptr);
     //Returns -1 if not there
     int getHeaderI(QString key, bool *valid = nullptr);
+    int getHeaderI(Header::Key key, bool *valid = nullptr);
 
     template <typename ...Tz> bool checkResponse(Res<QString,Tz...> cb, Tz ...args)
     {
         Q_ASSERT(isType(RESPONSE));
-        bool ok;
-        auto status = getHeaderS("status", &ok);
-        Q_ASSERT(ok);
-        if (status == "okay")
+        Header *status = header(Header::KeyStatus);
+        Q_ASSERT(status != nullptr);
+        if (status != nullptr && status->equals("okay"))
         {
             return true;
         }
-        cb(getHeaderS("reason"), args...);
+        cb(getHeaderS(Header::KeyReason), args...);
         return false;
     }
 
@@ -317,6 +459,11 @@ public:
 
     void addHeader(Header *h)
     {
+        Header::Key k = h->knownKey();
+        if (k != Header::KeyUnknown && m_index[k] < 0)
+        {
+            m_index[k] = headers.size();
+        }
         headers.append(h);
     }
     void addHeader(QString key, QString val)
@@ -335,14 +482,55 @@ public:
     {
         ros.append(ro);
     }
+    //Adds an object shared with other frames, which this frame keeps alive
+    //rather than destroys
+    void addSharedRoutingObject(const QSharedPointer<RoutingObject> &ro)
+    {
+        ros.append(ro.data());
+        m_sharedRos.append(ro);
+    }
+    //Keeps the receive block that unowned headers/POs/ROs point into alive
+    void retainBlock(const QByteArray &block)
+    {
+        m_block = block;
+    }
+    //Exact number of bytes appendTo will produce
+    int encodedLength();
+    //Serializes the frame onto the end of out in one go
+    void appendTo(QByteArray &out);
     void writeTo(QIODevice *o);
 private:
+    static size_t alignUp(size_t n)
+    {
+        const size_t a = alignof(std::max_align_t);
+        return (n + a - 1) & ~(a - 1);
+    }
+    static void destroyWithArena(Frame *f);
+    template <typename T> void release(T *o)
+    {
+        const char *p = reinterpret_cast<const char*>(o);
+        if (p >= m_arena && p < m_arena + m_arenaSize)
+        {
+            o->~T();
+        }
+        else
+        {
+            delete o;
+        }
+    }
     AgentConnection *agent;
     char m_type[5];
     const quint32 m_seqno;
     QList<PayloadObject*> pos;
     QList<RoutingObject*> ros;
+    QList<QSharedPointer<RoutingObject>> m_sharedRos;
     QList<Header*> headers;
+    //Position in headers of the first header for each known key
+    int m_index[Header::NumKnownKeys];
+    QByteArray m_block;
+    char *m_arena;
+    size_t m_arenaSize;
+    size_t m_arenaUsed;
 
     friend Message;
 };
@@ -352,18 +540,96 @@ typedef QSharedPointer<Frame> PFrame;
 Q_DECLARE_METATYPE(PFrame)
 Q_DECLARE_METATYPE(function<void(PFrame,bool)>)
 
+typedef function<void(PFrame f, bool final)> TransactionCallback;
+
+/**
+ * @brief Agent connection counters, as returned by BW::connectionStats()
+ *
+ * @ingroup cpp
+ * @since 1.5
+ */
+struct ConnectionStats
+{
+    ConnectionStats()
+        : disconnects(0), reconnects(0), heartbeatTimeouts(0), failedTransactions(0),
+          lastRecoveryMsecs(-1), totalDowntimeMsecs(0), timedOutTransactions(0) {}
+    /// Times an established connection was lost
+    quint64 disconnects;
+    /// Times the connection came back after being lost
+    quint64 reconnects;
+    /// Disconnects because the agent stopped answering heartbeats
+    quint64 heartbeatTimeouts;
+    /// Requests failed because the connection was lost while they awaited a response
+    quint64 failedTransactions;
+    /// From losing the connection to having it back with the entity set, for the last outage. -1 if there was none
+    qint64 lastRecoveryMsecs;
+    /// The same, summed over all outages
+    qint64 totalDowntimeMsecs;
+    /// Requests failed because the agent did not answer them in time, see BW::setRequestTimeout()
+    quint64 timedOutTransactions;
+};
+
+/*
+ * Outstanding transactions keyed by seqno. Any thread may add one, and the
+ * I/O thread looks them up as frames arrive. Sequence numbers are handed
+ * out consecutively, so spreading them over shards by their low bits keeps
+ * concurrent callers on different locks.
+ */
+class TransactionTable
+{
+public:
+    struct Entry
+    {
+        Entry() : thread(nullptr), persistent(false), timeout(0), openEnded(false), answered(false) {}
+        //The thread the callback must run on, the I/O thread itself if null
+        QThread *thread;
+        //Outlives the connection, see AgentConnection::transact
+        bool persistent;
+        //How long the agent may go without sending a frame for it, 0 for ever
+        int timeout;
+        //Once answered it may go quiet indefinitely, as a subscription does
+        bool openEnded;
+        //A frame of the response has arrived, so more may follow after it
+        //is dropped. Otherwise the agent may never mention it again
+        bool answered;
+        //Shared so that looking an entry up never copies the callback itself
+        QSharedPointer<TransactionCallback> cb;
+    };
+
+    void insert(quint32 seqno, const Entry &e);
+    //Moves the entry into out (removing it) if take is set, otherwise copies
+    //it and marks it answered, for a frame that does not finish it
+    bool find(quint32 seqno, bool take, Entry *out);
+    //Empties the table into out
+    void takeAll(QList<QPair<quint32, Entry>> *out);
+
+private:
+    static const int NumShards = 16;
+    struct Shard
+    {
+        QMutex lock;
+        QHash<quint32, Entry> entries;
+    };
+    Shard m_shards[NumShards];
+};
+
 class AgentConnection : public QObject
 {
     Q_OBJECT
 public:
     explicit AgentConnection(QObject *parent = 0)
-        : QObject(parent), m_ragent(false), m_our_sk(), m_our_vk(), m_ragent_handshake(0)
+        : QObject(parent), sock(nullptr), m_ragent(false), m_our_sk(), m_our_vk(), m_ragent_handshake(0),
+          m_up(false), m_everUp(false), m_downAnnounced(false), m_attempt(0),
+          m_entitySeqno(0), m_heartbeatInterval(5000), m_probing(false), m_requestTimeout(60000),
+          m_deadlines(DeadlineTickMsecs)
     {
         qRegisterMetaType<PFrame>();
         qRegisterMetaType<function<void(PFrame,bool)>>();
         seqno = 1;
         have_received_helo = false;
-        outstanding = QHash<quint32, function<void(PFrame,bool)>>();
+        m_flushQueued = false;
+        m_txbuf.reserve(TxFlushThreshold);
+        initTimers();
         //All our stuff will happen on this thread
         m_thread = new QThread(this);
         m_thread->start();
@@ -405,20 +671,61 @@ public:
         QMetaObject::invokeMethod(this,"initSock");
     }
 
-    void transact(QObject *to, PFrame f, function<void(PFrame f, bool final)> cb);
-    PFrame newFrame(const char *type, quint32 seqno=0);
+    //Sends f and calls cb on to's thread for every frame of the response.
+    //If the connection is lost first, cb gets an error response, unless the
+    //transaction is persistent: that is state (a subscription, a view) the
+    //caller restores itself once reconnected(), so it is dropped quietly.
+    //This may be called from any thread.
+    void transact(QObject *to, PFrame f, function<void(PFrame f, bool final)> cb, bool persistent = false);
+    //As transact, with cb called on thread instead. A null thread calls cb
+    //on the I/O thread as soon as the frame is parsed, so it must be quick.
+    //A timeout other than -1 overrides setRequestTimeout for this one.
+    void transactOn(QThread *thread, PFrame f, function<void(PFrame f, bool final)> cb, bool persistent = false,
+                    int timeoutMsecs = -1);
+    //Drops the callback of a transaction that has not finished. If the
+    //agent has answered it, the frames it still sends for it are skipped
+    //without being decoded, though any already on their way to the
+    //callback's thread arrive there. Otherwise they are dropped on arrival.
+    //This may be called from any thread.
+    void cancel(quint32 seqno);
+    //Sends f without waiting for a response, any that arrives is dropped.
+    //This may be called from any thread.
+    void send(PFrame f);
+    //With a nonzero arenaSize the frame gets an arena for its objects, see Frame::make
+    PFrame newFrame(const char *type, quint32 seqno=0, int arenaSize=0);
+    //How long the link may be silent before the agent is asked for a sign
+    //of life, and how much longer before it is given up on. 0 turns
+    //heartbeats off. This may be called from any thread.
+    void setHeartbeat(int msecs);
+    //How long a request may wait for the next frame of its response before
+    //it fails, and later frames for it are skipped. Subscriptions and views
+    //only wait for their first. 0 waits for ever.
+    //This may be called from any thread.
+    void setRequestTimeout(int msecs);
+    ConnectionStats stats();
 private:
     quint32 getSeqNo();
-    void readRO(QStringList &tokens);
-    void readPO(QStringList &tokens);
-    void readKV(QStringList &tokens);
     QAtomicInt seqno;
     QTcpSocket *sock;
     QThread    *m_thread;
-    PFrame  curFrame;
-    int waitingFor;
-    QHash<quint32, function<void(PFrame f, bool final)>> outstanding;
-    void transact(PFrame f, function<void(PFrame f, bool final)> cb);
+    FrameParser m_parser;
+    //Frames waiting to be written in the next coalesced write
+    static const int TxFlushThreshold = 64*1024;
+    QByteArray m_txbuf;
+    //The frames not written yet. While the link is up their bytes are in
+    //m_txbuf, while it is down they are held as they are, so those whose
+    //transaction ends meanwhile can be dropped
+    struct TxFrame
+    {
+        PFrame f;
+        bool tracked;
+    };
+    QList<TxFrame> m_txFrames;
+    //Transactions written while the link was up that have not finished.
+    //Only these are failed when it goes down, the rest are still held
+    QSet<quint32> m_written;
+    bool m_flushQueued;
+    TransactionTable m_transactions;
     void onArrivedFrame(PFrame f);
     bool have_received_helo;
     QString m_desthost;
@@ -428,16 +735,82 @@ private:
     QByteArray m_our_vk;
     QByteArray m_remote_vk;
     int m_ragent_handshake;
+
+    //Frames are only written while the link is up, and held until then
+    bool m_up;
+    bool m_everUp;
+    //agentChanged(false) has been sent for the current outage
+    bool m_downAnnounced;
+    //Reconnection attempts since the link was last up
+    int m_attempt;
+    QElapsedTimer m_downSince;
+    //The last sete frame sent, sent again first thing on reconnecting
+    QByteArray m_entityFrame;
+    //The seqno of a held sete with a transaction, 0 if there is none
+    quint32 m_entitySeqno;
+    QTimer *m_retryTimer;
+    QTimer *m_heartbeatTimer;
+    int m_heartbeatInterval;
+    QElapsedTimer m_lastRx;
+    bool m_probing;
+    QMutex m_statsLock;
+    ConnectionStats m_stats;
+    //Deadlines of the transactions waiting on the agent, by seqno, checked
+    //once a tick while there are any
+    static const int DeadlineTickMsecs = 100;
+    QAtomicInt m_requestTimeout;
+    QElapsedTimer m_clock;
+    TimerWheel m_deadlines;
+    QTimer *m_deadlineTimer;
+    void arm(quint32 seqno, int timeout);
+    //Drops the held frame of a transaction that has ended
+    void unhold(quint32 seqno);
+    //Fails the transaction with an error response on its own thread
+    void fail(quint32 seqno, TransactionTable::Entry &e, QString reason);
+    void initTimers();
+    void linkUp();
+    void linkDown(QString why);
+    void scheduleReconnect();
 private slots:
     void onConnect();
     void onError();
+    void onHeartbeat();
+    void onDeadline();
     void onArrivedData();
     void initSock();
-    void doTransact(PFrame f);
+    //Tracked frames are those of transactOn, that have a table entry
+    void doTransact(PFrame f, bool tracked);
+    void flushTx();
     void onSslErrors(QList<QSslError> errs);
 signals:
     void agentChanged(bool connected, QString msg);
+    //The link is back after being lost and the entity is set again. Frames
+    //sent meanwhile have gone out, persistent state is for the receiver
+    //to restore
+    void reconnected();
+
+};
 
+/*
+ * A transaction that may be cancelled, from any thread and at any point,
+ * including before it has been sent because something else (an access
+ * chain, say) has to be looked up first.
+ */
+class TransactionHandle
+{
+public:
+    TransactionHandle() : m_seqno(0), m_cancelled(false) {}
+    //Records where the transaction went once it has been handed to conn.
+    //If it was cancelled before that, it is cancelled there right away
+    void started(AgentConnection *conn, quint32 seqno);
+    void cancel();
+    bool isCancelled();
+private:
+    QMutex m_lock;
+    QPointer<AgentConnection> m_conn;
+    quint32 m_seqno;
+    bool m_cancelled;
 };
+typedef QSharedPointer<TransactionHandle> PTransactionHandle;
 
 #endif // QTLIBBW_AGENTCONNECTION_H
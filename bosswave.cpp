@@ -1,16 +1,27 @@
 #include "bosswave.h"
 
 #include "allocations.h"
+#include "metadatacache.h"
+#include "resolvecache.h"
+#include "routingobjectcache.h"
 
 #include <QFile>
 #include <QProcessEnvironment>
 #include <QQmlEngine>
+#include <QThread>
 
 #include <msgpack.h>
+#include <msgpackutf8.h>
 
 #include <cmath>
 #include <cstdio>
 
+// Text payloads stop at the first NUL, as they did when read with QString(QByteArray)
+static QString textContent(PayloadObject *po)
+{
+    return MsgPack::fromUtf8(po->content(), qstrnlen(po->content(), po->length()));
+}
+
 class NotImplementedException : public std::exception
 {
 public:
@@ -62,10 +73,20 @@ BW::BW(QObject *parent):
 {
     Q_ASSERT(this->thread() == QCoreApplication::instance()->thread());
     m_agent = NULL;
+    m_agentConnections = 1;
+    m_requestTimeout = 60000;
+    m_publishWindow = 64;
+    m_publishBackpressure = false;
+    m_nextListener = 0;
+    m_agentHeartbeat = 5000;
+    m_metadata = new MetadataCache(this, 30000);
+    m_resolve = new ResolveCache(1024);
 }
 
 BW::~BW()
 {
+    delete m_metadata;
+    delete m_resolve;
 }
 
 QObject *BW::qmlSingleton(QQmlEngine *engine, QJSEngine *scriptEngine)
@@ -98,14 +119,46 @@ int BW::fromDF(QString df)
 
 void BW::connectAgent(QByteArray &ourentity)//QString host, quint16 port)
 {
-    if (m_agent != NULL)
-    {
-        m_agent->deleteLater();
-        m_agent = NULL;
+    foreach (AgentConnection *a, m_agents)
+    {
+        a->deleteLater();
+    }
+    m_agents.clear();
+    m_directHandles.clear();
+    //What the old agent knew about us is gone with it, and nothing tells the
+    //new one. Anyone still waiting for a subscription to be made fails
+    auto subs = m_subscriptions;
+    m_subscriptions.clear();
+    m_subscriptionHandles.clear();
+    m_views.clear();
+    foreach (PSharedSubscription sub, subs)
+    {
+        sub->attempt++;
+        sub->listeners.clear();
+        auto pending = sub->pending;
+        sub->pending.clear();
+        for (auto i = pending.begin(); i != pending.end(); i++)
+        {
+            i->second(QStringLiteral("agent connection replaced"), QStringLiteral(""));
+        }
     }
     QProcessEnvironment qpe = QProcessEnvironment::systemEnvironment();
-    m_agent = new AgentConnection();
-    connect(m_agent,&AgentConnection::agentChanged,this,&BW::agentChanged);
+    for (int i = 0; i < m_agentConnections; i++)
+    {
+        AgentConnection *a = new AgentConnection();
+        a->setHeartbeat(m_agentHeartbeat);
+        a->setRequestTimeout(m_requestTimeout);
+        if (i == 0)
+        {
+            connect(a,&AgentConnection::agentChanged,this,&BW::agentChanged);
+        }
+        connect(a,&AgentConnection::reconnected,this,[this, a]()
+        {
+            onAgentReconnected(a);
+        });
+        m_agents.append(a);
+    }
+    m_agent = m_agents.first();
 #ifdef Q_OS_ANDROID
     char *cp = new char[ourentity.length()];
     memcpy(cp,ourentity.data(),ourentity.length());
@@ -115,31 +168,104 @@ void BW::connectAgent(QByteArray &ourentity)//QString host, quint16 port)
     QByteArray vk = e->vk;
     QByteArray remvk = QByteArray::fromBase64("gdIHa4kskW9_gAKm4liWnLPN7lQ8N4L2oqCCdK112fA=", QByteArray::Base64UrlEncoding);
     qDebug() << "doing RAGENT conn";
-    m_agent->beginRagentConnection(sk, vk, "ragent.cal-sdb.org", 28590, remvk);
+    foreach (AgentConnection *a, m_agents)
+    {
+        a->beginRagentConnection(sk, vk, "ragent.cal-sdb.org", 28590, remvk);
+    }
 #else
     Q_UNUSED(ourentity);
     qDebug() << "doing normal conn";
     QString hostcolonport = qpe.value("BW2_AGENT", "");
-    if (hostcolonport.isEmpty())
-    {
-        m_agent->beginConnection("localhost",28589);
-    }
-    else
+    QString host = "localhost";
+    int port = 28589;
+    if (!hostcolonport.isEmpty())
     {
         QStringList parts = hostcolonport.split(":");
         if (parts.length() != 2) {
             qFatal("$BW2_AGENT is improperly set");
         }
         bool ok;
-        int port = parts[1].toInt(&ok);
+        port = parts[1].toInt(&ok);
         if (!ok || port < 0 || port > 65535) {
             qFatal("Invalid port in $BW2_AGENT");
         }
-        m_agent->beginConnection(parts[0], port);
+        host = parts[0];
+    }
+    foreach (AgentConnection *a, m_agents)
+    {
+        a->beginConnection(host, port);
     }
 #endif
 }
 
+void BW::onAgentReconnected(AgentConnection *conn)
+{
+    Q_ASSERT(QThread::currentThread() == this->thread());
+    if (!m_agents.contains(conn))
+    {
+        //From before connectAgent was called again
+        return;
+    }
+    //The connection has set our entity again, the rest of what the agent
+    //knew about us on it is up to us
+    foreach (PSharedSubscription sub, m_subscriptions)
+    {
+        if (agentFor(sub->uri) == conn)
+        {
+            subscribeShared(sub);
+        }
+    }
+    if (conn != m_agent)
+    {
+        return;
+    }
+    m_views.removeAll(QPointer<BWView>());
+    foreach (QPointer<BWView> v, m_views)
+    {
+        openView(v, [](QString, BWView*) {});
+    }
+}
+
+void BW::setAgentHeartbeat(int msecs)
+{
+    m_agentHeartbeat = qMax(msecs, 0);
+    foreach (AgentConnection *a, m_agents)
+    {
+        a->setHeartbeat(m_agentHeartbeat);
+    }
+}
+
+void BW::setRequestTimeout(int msecs)
+{
+    m_requestTimeout = qMax(msecs, 0);
+    foreach (AgentConnection *a, m_agents)
+    {
+        a->setRequestTimeout(m_requestTimeout);
+    }
+}
+
+void BW::setAgentConnections(int count)
+{
+    m_agentConnections = qMax(count, 1);
+}
+
+ConnectionStats BW::connectionStats()
+{
+    ConnectionStats rv;
+    foreach (AgentConnection *a, m_agents)
+    {
+        ConnectionStats s = a->stats();
+        rv.disconnects += s.disconnects;
+        rv.reconnects += s.reconnects;
+        rv.heartbeatTimeouts += s.heartbeatTimeouts;
+        rv.failedTransactions += s.failedTransactions;
+        rv.timedOutTransactions += s.timedOutTransactions;
+        rv.lastRecoveryMsecs = qMax(rv.lastRecoveryMsecs, s.lastRecoveryMsecs);
+        rv.totalDowntimeMsecs += s.totalDowntimeMsecs;
+    }
+    return rv;
+}
+
 AgentConnection* BW::agent()
 {
     if (m_agent == NULL)
@@ -149,6 +275,17 @@ AgentConnection* BW::agent()
     return m_agent;
 }
 
+AgentConnection* BW::agentFor(const QString &uri)
+{
+    AgentConnection *a = agent();
+    if (m_agents.size() == 1)
+    {
+        return a;
+    }
+    //Always the same one for a URI, so its traffic stays in order
+    return m_agents[qHash(uri) % uint(m_agents.size())];
+}
+
 void BW::createEntity(QDateTime expiry, qreal expiryDelta, QString contact,
                       QString comment, QList<QString> revokers, bool omitCreationDate,
                       Res<QString, QString, QByteArray> on_done)
@@ -187,7 +324,7 @@ void BW::createEntity(QDateTime expiry, qreal expiryDelta, QString contact,
                 on_done("invalid reponse", "", "");
                 return;
             }
-            QString vk = f->getHeaderS("vk");
+            QString vk = f->getHeaderS(Header::KeyVK);
             on_done("", vk, po->contentArray());
         }
     });
@@ -261,7 +398,7 @@ void BW::createDOT(bool isPermission, QString to, unsigned int ttl, QDateTime ex
             {
                 on_done("invalid response", "", "");
             }
-            QString hash = f->getHeaderS("hash");
+            QString hash = f->getHeaderS(Header::KeyHash);
             on_done("", hash, po->contentArray());
         }
     });
@@ -313,7 +450,7 @@ void BW::createDOTChain(QList<QString> dots, bool isPermission, bool unElaborate
                 on_done("bad response", "", nullptr);
                 return;
             }
-            QString hash = f->getHeaderS("hash");
+            QString hash = f->getHeaderS(Header::KeyHash);
             RoutingObject* ro = ros[0];
 
             on_done("", hash, ro);
@@ -334,10 +471,42 @@ void BW::createDOTChain(QVariantMap params, QJSValue on_done)
 void BW::publish(QString uri, QString primaryAccessChain, bool autoChain,
                  QList<RoutingObject*> roz, QList<PayloadObject*> poz,
                  QDateTime expiry, qreal expiryDelta, QString elaboratePAC, bool doNotVerify,
-                 bool persist, Res<QString> on_done)
+                 bool persist, Res<QString> on_done, PublishMode mode)
+{
+    if (!autoChain || primaryAccessChain.length() != 0 || !roz.isEmpty())
+    {
+        sendPublish(uri, primaryAccessChain, autoChain, roz, poz, expiry, expiryDelta,
+                    elaboratePAC, doNotVerify, persist, on_done, mode);
+        return;
+    }
+    withAccessChain(uri, true, [=](QString hash, RoutingObject *chain, std::function<void()> drop)
+    {
+        if (hash.length() == 0)
+        {
+            sendPublish(uri, "", true, roz, poz, expiry, expiryDelta,
+                        elaboratePAC, doNotVerify, persist, on_done, mode);
+            return;
+        }
+        sendPublish(uri, hash, false, {chain}, poz, expiry, expiryDelta,
+                    elaboratePAC, doNotVerify, persist, [=](QString error)
+        {
+            if (error.length() != 0)
+            {
+                drop();
+            }
+            on_done(error);
+        }, mode);
+    });
+}
+
+void BW::sendPublish(QString uri, QString primaryAccessChain, bool autoChain,
+                     QList<RoutingObject*> roz, QList<PayloadObject*> poz,
+                     QDateTime expiry, qreal expiryDelta, QString elaboratePAC, bool doNotVerify,
+                     bool persist, Res<QString> on_done, PublishMode mode)
 {
     const char* cmd = persist ? Frame::PERSIST : Frame::PUBLISH;
-    auto f = agent()->newFrame(cmd);
+    AgentConnection *conn = agentFor(uri);
+    auto f = conn->newFrame(cmd);
     if (autoChain)
     {
         f->addHeader("autochain", "true");
@@ -375,24 +544,153 @@ void BW::publish(QString uri, QString primaryAccessChain, bool autoChain,
     f->addHeader("doverify", doNotVerify ? "false" : "true");
     f->addHeader("persist", persist ? "true" : "false");
 
-    agent()->transact(this, f, [=](PFrame f, bool)
+    if (mode == PublishNoAck)
     {
-        if(f->checkResponse(on_done))
+        conn->send(f);
+        {
+            QMutexLocker l(&m_publishLock);
+            m_publishStats.unacknowledged++;
+        }
+        on_done("");
+        return;
+    }
+    if (mode == PublishWindowed)
+    {
+        publishWindowed(f, on_done);
+        return;
+    }
+
+    {
+        QMutexLocker l(&m_publishLock);
+        m_publishStats.sent++;
+    }
+    conn->transact(this, f, [=](PFrame f, bool)
+    {
+        bool ok = f->checkResponse(on_done);
+        if (ok)
         {
             on_done("");
         }
+        onPublishDone(ok, false);
     });
 }
 
+void BW::publishWindowed(PFrame f, Res<QString> on_done)
+{
+    QMutexLocker l(&m_publishLock);
+    if (m_publishStats.inFlight >= m_publishWindow)
+    {
+        m_publishQueue.enqueue(qMakePair(f, on_done));
+        m_publishStats.queued = m_publishQueue.size();
+        bool engaged = !m_publishBackpressure;
+        m_publishBackpressure = true;
+        l.unlock();
+        if (engaged)
+        {
+            emit publishBackpressure(true);
+        }
+        return;
+    }
+    m_publishStats.inFlight++;
+    m_publishStats.sent++;
+    l.unlock();
+    sendWindowed(f, on_done);
+}
+
+void BW::sendWindowed(PFrame f, Res<QString> on_done)
+{
+    f->connection()->transact(this, f, [=](PFrame f, bool)
+    {
+        bool ok = f->checkResponse(on_done);
+        if (ok)
+        {
+            on_done("");
+        }
+        onPublishDone(ok, true);
+    });
+}
+
+void BW::onPublishDone(bool ok, bool windowed)
+{
+    {
+        QMutexLocker l(&m_publishLock);
+        if (ok)
+        {
+            m_publishStats.acknowledged++;
+        }
+        else
+        {
+            m_publishStats.failed++;
+        }
+        if (!windowed)
+        {
+            return;
+        }
+        m_publishStats.inFlight--;
+    }
+    pumpPublishQueue();
+}
+
+void BW::pumpPublishQueue()
+{
+    //Refill the window from the queue, in order
+    QMutexLocker l(&m_publishLock);
+    QList<QPair<PFrame, Res<QString>>> ready;
+    while (m_publishStats.inFlight < m_publishWindow && !m_publishQueue.isEmpty())
+    {
+        ready.append(m_publishQueue.dequeue());
+        m_publishStats.inFlight++;
+        m_publishStats.sent++;
+    }
+    m_publishStats.queued = m_publishQueue.size();
+    bool released = m_publishBackpressure && m_publishQueue.isEmpty();
+    if (released)
+    {
+        m_publishBackpressure = false;
+    }
+    l.unlock();
+
+    foreach (auto p, ready)
+    {
+        sendWindowed(p.first, p.second);
+    }
+    if (released)
+    {
+        emit publishBackpressure(false);
+    }
+}
+
+void BW::setPublishWindow(int maxInFlight)
+{
+    {
+        QMutexLocker l(&m_publishLock);
+        m_publishWindow = qMax(1, maxInFlight);
+    }
+    //A bigger window may let queued publishes go
+    pumpPublishQueue();
+}
+
+int BW::publishWindow()
+{
+    QMutexLocker l(&m_publishLock);
+    return m_publishWindow;
+}
+
+PublishStats BW::publishStats()
+{
+    QMutexLocker l(&m_publishLock);
+    return m_publishStats;
+}
+
 
 void BW::publishMsgPack(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
                         int ponum, QVariantMap val, QDateTime expiry, qreal expiryDelta,
                         QString elaboratePAC, bool doNotVerify, bool persist,
-                        Res<QString> on_done)
+                        Res<QString> on_done, PublishMode mode)
 {
     QByteArray contents = MsgPack::pack(val);
-    PayloadObject* po = createBasePayloadObject(ponum, contents.data(), contents.length());
-    publish(uri, primaryAccessChain, autoChain, roz, {po}, expiry, expiryDelta, elaboratePAC, doNotVerify, persist, on_done);
+    PayloadObject* po = createBasePayloadObject(ponum, contents);
+    publish(uri, primaryAccessChain, autoChain, roz, {po}, expiry, expiryDelta, elaboratePAC, doNotVerify, persist, on_done, mode);
 }
 
 void BW::publishMsgPack(QVariantMap params, QJSValue on_done)
@@ -433,19 +731,25 @@ void BW::publishMsgPack(QVariantMap params, QJSValue on_done)
         expiryDelta = params["ExpiryDelta"].toReal();
     }
 
+    PublishMode mode = PublishAcked;
+    if (params.contains("Mode"))
+    {
+        mode = (PublishMode) params["Mode"].toInt();
+    }
+
     this->publishMsgPack(uri, primaryAccessChain, autoChain, roz, ponum,
                          payload, expiry, expiryDelta, elaboratePAC,
-                         doNotVerify, persist, ERes<QString>(on_done));
+                         doNotVerify, persist, ERes<QString>(on_done), mode);
 }
 
 void BW::publishText(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
                      int PONum, QString msg, QDateTime expiry, qreal expiryDelta,
                      QString elaboratePAC, bool doNotVerify, bool persist,
-                     Res<QString> on_done)
+                     Res<QString> on_done, PublishMode mode)
 {
     QByteArray encoded = msg.toUtf8();
     PayloadObject* po = createBasePayloadObject(PONum, encoded);
-    publish(uri, primaryAccessChain, autoChain, roz, {po}, expiry, expiryDelta, elaboratePAC, doNotVerify, persist, on_done);
+    publish(uri, primaryAccessChain, autoChain, roz, {po}, expiry, expiryDelta, elaboratePAC, doNotVerify, persist, on_done, mode);
 }
 
 void BW::publishText(QVariantMap params, QJSValue on_done)
@@ -486,17 +790,218 @@ void BW::publishText(QVariantMap params, QJSValue on_done)
         expiryDelta = params["ExpiryDelta"].toReal();
     }
 
+    PublishMode mode = PublishAcked;
+    if (params.contains("Mode"))
+    {
+        mode = (PublishMode) params["Mode"].toInt();
+    }
+
     this->publishText(uri, primaryAccessChain, autoChain, roz, ponum,
                       payload, expiry, expiryDelta, elaboratePAC,
-                      doNotVerify, persist, ERes<QString>(on_done));
+                      doNotVerify, persist, ERes<QString>(on_done), mode);
 }
 
 void BW::subscribe(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
                    QDateTime expiry, qreal expiryDelta, QString elaboratePAC,
                    bool doNotVerify, bool leavePacked, Res<PMessage> on_msg,
-                   Res<QString, QString> on_done)
+                   Res<QString, QString> on_done, MessageDelivery delivery)
+{
+    if (QThread::currentThread() != this->thread())
+    {
+        //The registry of shared subscriptions is only touched on our thread
+        ThreadDispatcher::forThread(this->thread())->post([=]
+        {
+            subscribe(uri, primaryAccessChain, autoChain, roz, expiry, expiryDelta, elaboratePAC,
+                      doNotVerify, leavePacked, on_msg, on_done, delivery);
+        });
+        return;
+    }
+    //Routing objects and expiry make a subscription unlike any other, and
+    //listeners are only fanned out to on this thread
+    if (!roz.isEmpty() || expiry.isValid() || expiryDelta >= 0 ||
+        delivery.mode != MessageDelivery::BWThread)
+    {
+        subscribeDirect(uri, primaryAccessChain, autoChain, roz, expiry, expiryDelta,
+                        elaboratePAC, doNotVerify, leavePacked, on_msg, on_done, false, delivery);
+        return;
+    }
+    if (elaboratePAC.length() == 0)
+    {
+        elaboratePAC = elaboratePartial;
+    }
+    QString key = QStringLiteral("%1\n%2\n%3\n%4%5%6").arg(uri, primaryAccessChain, elaboratePAC)
+            .arg(int(autoChain)).arg(int(doNotVerify)).arg(int(leavePacked));
+
+    quint64 id = ++m_nextListener;
+    PSharedSubscription sub = m_subscriptions.value(key);
+    if (!sub.isNull())
+    {
+        sub->listeners.insert(id, on_msg);
+        if (sub->established)
+        {
+            QString handle = sharedHandle(sub->handle, id);
+            m_subscriptionHandles.insert(handle, qMakePair(sub, id));
+            on_done("", handle);
+        }
+        else
+        {
+            sub->pending.append(qMakePair(id, on_done));
+        }
+        return;
+    }
+
+    sub = PSharedSubscription(new SharedSubscription());
+    sub->key = key;
+    sub->uri = uri;
+    sub->primaryAccessChain = primaryAccessChain;
+    sub->autoChain = autoChain;
+    sub->elaboratePAC = elaboratePAC;
+    sub->doNotVerify = doNotVerify;
+    sub->leavePacked = leavePacked;
+    sub->listeners.insert(id, on_msg);
+    sub->pending.append(qMakePair(id, on_done));
+    m_subscriptions.insert(key, sub);
+    subscribeShared(sub);
+}
+
+void BW::subscribeShared(PSharedSubscription sub)
 {
-    auto f = agent()->newFrame(Frame::SUBSCRIBE);
+    //Only the latest attempt counts. One made before a reconnect may still
+    //get through if it was held rather than lost
+    int attempt = ++sub->attempt;
+    subscribeDirect(sub->uri, sub->primaryAccessChain, sub->autoChain, QList<RoutingObject*>(),
+                    QDateTime(), -1, sub->elaboratePAC, sub->doNotVerify, sub->leavePacked,
+                    [=](PMessage m)
+    {
+        if (attempt == sub->attempt)
+        {
+            onSharedSubscribeMessage(sub, m);
+        }
+    }, [=](QString err, QString handle)
+    {
+        if (attempt != sub->attempt)
+        {
+            if (err.length() == 0)
+            {
+                unsubscribeAgent(agentFor(sub->uri), handle, _nop_res_status);
+            }
+        }
+        else if (!sub->established)
+        {
+            onSharedSubscribeResponse(sub, err, handle);
+        }
+        else if (err.length() != 0)
+        {
+            //Its listeners are told, and the next subscribe to the same
+            //starts afresh rather than joining a dead handle
+            qWarning() << "could not restore subscription to" << sub->uri << ":" << err;
+            if (m_subscriptions.value(sub->key) == sub)
+            {
+                m_subscriptions.remove(sub->key);
+            }
+            auto listeners = sub->listeners;
+            sub->listeners.clear();
+            for (auto i = listeners.begin(); i != listeners.end(); i++)
+            {
+                QString local = sharedHandle(sub->handle, i.key());
+                m_subscriptionHandles.remove(local);
+                emit subscriptionLost(local, err);
+            }
+        }
+        else
+        {
+            //Restored after a reconnect. Local handles stay as they were
+            sub->handle = handle;
+        }
+    }, true);
+}
+
+void BW::onSharedSubscribeResponse(PSharedSubscription sub, QString err, QString handle)
+{
+    auto pending = sub->pending;
+    sub->pending.clear();
+    if (!err.isEmpty())
+    {
+        //Everyone who joined while we waited fails along with the first
+        if (m_subscriptions.value(sub->key) == sub)
+        {
+            m_subscriptions.remove(sub->key);
+        }
+        sub->listeners.clear();
+        for (auto i = pending.begin(); i != pending.end(); i++)
+        {
+            i->second(err, QStringLiteral(""));
+        }
+        return;
+    }
+    sub->handle = handle;
+    sub->established = true;
+    for (auto i = pending.begin(); i != pending.end(); i++)
+    {
+        QString local = sharedHandle(handle, i->first);
+        m_subscriptionHandles.insert(local, qMakePair(sub, i->first));
+        i->second("", local);
+    }
+}
+
+void BW::onSharedSubscribeMessage(PSharedSubscription sub, PMessage m)
+{
+    //A listener may unsubscribe from within its callback
+    auto listeners = sub->listeners;
+    for (auto i = listeners.begin(); i != listeners.end(); i++)
+    {
+        if (sub->listeners.contains(i.key()))
+        {
+            i.value()(m);
+        }
+    }
+}
+
+QString BW::sharedHandle(const QString &handle, quint64 id)
+{
+    return QStringLiteral("%1#%2").arg(handle).arg(id);
+}
+
+void BW::subscribeDirect(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
+                         QDateTime expiry, qreal expiryDelta, QString elaboratePAC,
+                         bool doNotVerify, bool leavePacked, Res<PMessage> on_msg,
+                         Res<QString, QString> on_done, bool restorable,
+                         MessageDelivery delivery)
+{
+    QThread *deliverOn = deliveryThread(delivery);
+    if (!autoChain || primaryAccessChain.length() != 0 || !roz.isEmpty())
+    {
+        sendSubscribe(uri, primaryAccessChain, autoChain, roz, expiry, expiryDelta,
+                      elaboratePAC, doNotVerify, leavePacked, on_msg, on_done, restorable, deliverOn);
+        return;
+    }
+    withAccessChain(uri, false, [=](QString hash, RoutingObject *chain, std::function<void()> drop)
+    {
+        if (hash.length() == 0)
+        {
+            sendSubscribe(uri, "", true, roz, expiry, expiryDelta,
+                          elaboratePAC, doNotVerify, leavePacked, on_msg, on_done, restorable, deliverOn);
+            return;
+        }
+        sendSubscribe(uri, hash, false, {chain}, expiry, expiryDelta,
+                      elaboratePAC, doNotVerify, leavePacked, on_msg, [=](QString error, QString handle)
+        {
+            if (error.length() != 0)
+            {
+                drop();
+            }
+            on_done(error, handle);
+        }, restorable, deliverOn);
+    });
+}
+
+void BW::sendSubscribe(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
+                       QDateTime expiry, qreal expiryDelta, QString elaboratePAC,
+                       bool doNotVerify, bool leavePacked, Res<PMessage> on_msg,
+                       Res<QString, QString> on_done, bool restorable, QThread *deliverOn)
+{
+    AgentConnection *conn = agentFor(uri);
+    auto f = conn->newFrame(Frame::SUBSCRIBE);
     if (autoChain)
     {
         f->addHeader("autochain", "true");
@@ -528,22 +1033,54 @@ void BW::subscribe(QString uri, QString primaryAccessChain, bool autoChain, QLis
         f->addHeader("unpack", "true");
     }
     f->addHeader("doverify", doNotVerify ? "false": "true");
-    agent()->transact(this, f, [=](PFrame f, bool)
+    QSharedPointer<bool> answered(new bool(false));
+    QSharedPointer<QString> made(new QString());
+    auto respond = [=](PFrame f)
     {
-        if (f->isType(Frame::RESPONSE))
+        //A second response is the connection failing the subscription
+        //after the fact, and on_done has had its say
+        if (*answered)
         {
-
-            if(f->checkResponse(on_done, QStringLiteral("")))
+            qWarning() << "subscription to" << uri << "lost with the agent connection";
+            if (!made->isEmpty())
             {
-                QString handle = f->getHeaderS("handle");
-                on_done("", handle);
+                m_directHandles.remove(*made);
+                emit subscriptionLost(*made, f->getHeaderS(Header::KeyReason));
             }
+            return;
         }
-        else
+        *answered = true;
+        if(f->checkResponse(on_done, QStringLiteral("")))
+        {
+            QString handle = f->getHeaderS(Header::KeyHandle);
+            if (!restorable && m_agents.size() > 1)
+            {
+                m_directHandles.insert(handle, conn);
+            }
+            *made = handle;
+            on_done("", handle);
+        }
+    };
+    QThread *home = this->thread();
+    conn->transactOn(deliverOn, f, [=](PFrame f, bool)
+    {
+        if (!f->isType(Frame::RESPONSE))
         {
             on_msg(Message::fromFrame(f));
         }
-    });
+        else if (deliverOn == home)
+        {
+            respond(f);
+        }
+        else
+        {
+            //The subscription's state is kept on our own thread
+            ThreadDispatcher::forThread(home)->post([=]
+            {
+                respond(f);
+            });
+        }
+    }, restorable);
 }
 
 void BW::subscribeMsgPack(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
@@ -559,8 +1096,8 @@ void BW::subscribeMsgPack(QString uri, QString primaryAccessChain, bool autoChai
         {
             QVariant v = MsgPack::unpack(po->contentArray());
             QMap<QString,QVariant> minfo;
-            minfo[QString("uri")] = m->getHeaderS("uri");
-            minfo[QString("from")] = m->getHeaderS("from");
+            minfo[QString("uri")] = m->getHeaderS(Header::KeyURI);
+            minfo[QString("from")] = m->getHeaderS(Header::KeyFrom);
             on_msg(po->ponum(), v.toMap(), minfo);
         }
     }, on_done);
@@ -615,7 +1152,7 @@ void BW::subscribeText(QString uri, QString primaryAccessChain, bool autoChain,
     {
         foreach(auto po, m->FilterPOs(bwpo::num::Text, bwpo::mask::Text))
         {
-            on_msg(po->ponum(), QString(po->contentArray()));
+            on_msg(po->ponum(), textContent(po));
         }
     }, on_done);
 }
@@ -659,9 +1196,42 @@ void BW::subscribeText(QVariantMap params, QJSValue on_msg, QJSValue on_done)
 
 void BW::unsubscribe(QString handle, Res<QString> on_done)
 {
-    auto f = agent()->newFrame(Frame::UNSUBSCRIBE);
+    if (QThread::currentThread() != this->thread())
+    {
+        ThreadDispatcher::forThread(this->thread())->post([=]
+        {
+            unsubscribe(handle, on_done);
+        });
+        return;
+    }
+    auto local = m_subscriptionHandles.find(handle);
+    if (local == m_subscriptionHandles.end())
+    {
+        AgentConnection *conn = m_directHandles.take(handle);
+        unsubscribeAgent(conn != NULL ? conn : agent(), handle, on_done);
+        return;
+    }
+    PSharedSubscription sub = local->first;
+    sub->listeners.remove(local->second);
+    m_subscriptionHandles.erase(local);
+    if (!sub->listeners.isEmpty())
+    {
+        on_done("");
+        return;
+    }
+    //That was the last listener, so the agent subscription goes too
+    if (m_subscriptions.value(sub->key) == sub)
+    {
+        m_subscriptions.remove(sub->key);
+    }
+    unsubscribeAgent(agentFor(sub->uri), sub->handle, on_done);
+}
+
+void BW::unsubscribeAgent(AgentConnection *conn, QString handle, Res<QString> on_done)
+{
+    auto f = conn->newFrame(Frame::UNSUBSCRIBE);
     f->addHeader("handle", handle);
-    agent()->transact(this, f, [=](PFrame f, bool)
+    conn->transact(this, f, [=](PFrame f, bool)
     {
         if (f->checkResponse(on_done))
         {
@@ -696,17 +1266,53 @@ void BW::setEntityFile(QString filename, QJSValue on_done)
 
 void BW::setEntity(QByteArray keyfile, Res<QString, QString> on_done)
 {
-    auto f = agent()->newFrame(Frame::SET_ENTITY);
-    auto po = createBasePayloadObject(bwpo::num::ROEntityWKey, keyfile);
-    f->addPayloadObject(po);
-    agent()->transact(this, f, [=](PFrame f, bool)
-    {
-        if(f->checkResponse(on_done, QStringLiteral("")))
+    //Every connection acts as the entity. on_done hears once all of them
+    //have answered, with the first error if there was one
+    struct Replies
+    {
+        int waiting;
+        bool failed;
+        QString error;
+        QString vk;
+    };
+    //Without a connection this is fatal, as it is everywhere else
+    agent();
+    QSharedPointer<Replies> replies(new Replies());
+    replies->waiting = m_agents.size();
+    replies->failed = false;
+    foreach (AgentConnection *conn, m_agents)
+    {
+        bool primary = conn == m_agent;
+        auto f = conn->newFrame(Frame::SET_ENTITY);
+        auto po = createBasePayloadObject(bwpo::num::ROEntityWKey, keyfile);
+        f->addPayloadObject(po);
+        conn->transact(this, f, [=](PFrame f, bool)
         {
-            this->m_vk = f->getHeaderS("vk");
+            Res<QString> failure([=](QString error)
+            {
+                if (!replies->failed)
+                {
+                    replies->failed = true;
+                    replies->error = error;
+                }
+            });
+            if (f->checkResponse(failure) && primary)
+            {
+                replies->vk = f->getHeaderS(Header::KeyVK);
+            }
+            if (--replies->waiting > 0)
+            {
+                return;
+            }
+            if (replies->failed)
+            {
+                on_done(replies->error, QStringLiteral(""));
+                return;
+            }
+            this->m_vk = replies->vk;
             on_done("", this->m_vk);
-        }
-    });
+        });
+    }
 }
 
 void BW::setEntity(QByteArray keyfile, QJSValue on_done)
@@ -731,6 +1337,12 @@ void BW::setEntityFromEnviron(QJSValue on_done)
 
 void BW::buildChain(QString uri, QString permissions, QString to,
                     Res<QString, SimpleChain*, bool> on_done)
+{
+    startBuildChain(uri, permissions, to, on_done, PTransactionHandle());
+}
+
+void BW::startBuildChain(QString uri, QString permissions, QString to,
+                         Res<QString, SimpleChain*, bool> on_done, PTransactionHandle handle)
 {
     auto f = agent()->newFrame(Frame::BUILD_CHAIN);
     f->addHeader("uri", uri);
@@ -742,14 +1354,14 @@ void BW::buildChain(QString uri, QString permissions, QString to,
         sc->valid = false;
         if (f->checkResponse(on_done, sc, true))
         {
-            QString hash = f->getHeaderS("hash");
+            QString hash = f->getHeaderS(Header::KeyHash);
             if (hash != QStringLiteral(""))
             {
                 sc->valid = true;
                 sc->hash = hash;
-                sc->permissions = f->getHeaderS("permissions");
-                sc->to = f->getHeaderS("to");
-                sc->uri = f->getHeaderS("uri");
+                sc->permissions = f->getHeaderS(Header::KeyPermissions);
+                sc->to = f->getHeaderS(Header::KeyTo);
+                sc->uri = f->getHeaderS(Header::KeyURI);
                 PayloadObject* po = f->getPayloadObjects().value(0);
                 if (po == nullptr)
                 {
@@ -763,6 +1375,10 @@ void BW::buildChain(QString uri, QString permissions, QString to,
             on_done("", sc, final);
         }
     });
+    if (!handle.isNull())
+    {
+        handle->started(agent(), f->seqno());
+    }
 }
 
 void BW::buildChain(QVariantMap params, QJSValue on_done)
@@ -777,39 +1393,182 @@ void BW::buildChain(QVariantMap params, QJSValue on_done)
 void BW::buildAnyChain(QString uri, QString permissions, QString to,
                        Res<QString, SimpleChain*> on_done)
 {
-    bool* calledCB = new bool;
-    *calledCB = false;
+    //Once there is a chain, the agent need not look for more
+    PTransactionHandle handle(new TransactionHandle());
+    QSharedPointer<bool> calledCB(new bool(false));
 
-    this->buildChain(uri, permissions, to, [=](QString error, SimpleChain* chain, bool final)
+    startBuildChain(uri, permissions, to, [=](QString error, SimpleChain* chain, bool final)
     {
-        if (!*calledCB)
+        //The first valid chain, or the end of the results if there is none
+        if (*calledCB || (error.length() == 0 && !chain->valid && !final))
+        {
+            delete chain;
+            return;
+        }
+        *calledCB = true;
+        if (!final)
         {
-            on_done(error, chain);
-            *calledCB = true;
+            handle->cancel();
         }
+        on_done(error, chain);
+    }, handle);
+}
 
-        if (final)
+void BW::buildAnyChain(QVariantMap params, QJSValue on_done)
+{
+    QString uri = params["URI"].toString();
+    QString permissions = params["Permissions"].toString();
+    QString to = params["To"].toString();
+
+    this->buildAnyChain(uri, permissions, to, ERes<QString, SimpleChain*>(on_done));
+}
+
+void BW::withAccessChain(QString uri, bool publish,
+                         std::function<void(QString, RoutingObject*, std::function<void()>)> send)
+{
+    //Without our own entity we do not know whose chain the agent would build
+    QString vk = m_vk;
+    if (vk.length() == 0 || !m_resolve->keeps(ResolveAccessChain))
+    {
+        send("", nullptr, nullptr);
+        return;
+    }
+    QString permissions = publish ? QStringLiteral("P") : QStringLiteral("C");
+    if (uri.contains('+') || uri.contains('*'))
+    {
+        permissions += '*';
+    }
+    QByteArray key = QStringLiteral("%1\n%2\n%3").arg(uri, permissions, vk).toUtf8();
+
+    m_resolve->lookup(ResolveAccessChain, key, [=](ResolveCache::Done done)
+    {
+        AgentConnection *conn = agent();
+        auto f = conn->newFrame(Frame::BUILD_CHAIN);
+        f->addHeader("uri", uri);
+        f->addHeader("to", vk);
+        f->addHeader("addpermissions", permissions);
+        //Chains stream in, the first one will do
+        QSharedPointer<bool> answered(new bool(false));
+        conn->transact(this, f, [=](PFrame f, bool final)
+        {
+            if (*answered)
+            {
+                return;
+            }
+            ResolveResult r;
+            if (f->checkResponse(Res<QString>([&r](QString error) { r.error = error; })))
+            {
+                r.text = f->getHeaderS(Header::KeyHash);
+                PayloadObject* po = f->getPayloadObjects().value(0);
+                if (po != nullptr)
+                {
+                    r.bytes = po->contentArray();
+                }
+                r.found = r.text.length() != 0 && r.bytes.length() != 0;
+                if (!r.found && !final)
+                {
+                    return;
+                }
+            }
+            *answered = true;
+            if (!final)
+            {
+                conn->cancel(f->seqno());
+            }
+            done(r);
+        });
+    }, [=](const ResolveResult &r)
+    {
+        if (!r.found)
+        {
+            send("", nullptr, nullptr);
+            return;
+        }
+        //Each request's frame owns its routing objects
+        char *copy = new char[r.bytes.size()];
+        memcpy(copy, r.bytes.constData(), r.bytes.size());
+        RoutingObject *chain = new RoutingObject(bwpo::num::ROAccessDChain, copy, r.bytes.size());
+        send(r.text, chain, [=]
+        {
+            m_resolve->invalidate(ResolveAccessChain, key);
+        });
+    });
+}
+
+void BW::query(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
+               QDateTime expiry, qreal expiryDelta, QString elaboratePAC,
+               bool doNotVerify, bool leavePacked,
+               Res<QString, PMessage, bool> on_result, MessageDelivery delivery)
+{
+    startQuery(uri, primaryAccessChain, autoChain, roz, expiry, expiryDelta, elaboratePAC,
+               doNotVerify, leavePacked, on_result, deliveryThread(delivery), PTransactionHandle());
+}
+
+void BW::startQuery(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
+                    QDateTime expiry, qreal expiryDelta, QString elaboratePAC,
+                    bool doNotVerify, bool leavePacked,
+                    Res<QString, PMessage, bool> on_result, QThread *deliverOn,
+                    PTransactionHandle handle)
+{
+    if (!autoChain || primaryAccessChain.length() != 0 || !roz.isEmpty())
+    {
+        sendQuery(uri, primaryAccessChain, autoChain, roz, expiry, expiryDelta,
+                  elaboratePAC, doNotVerify, leavePacked, on_result, deliverOn, handle);
+        return;
+    }
+    withAccessChain(uri, false, [=](QString hash, RoutingObject *chain, std::function<void()> drop)
+    {
+        if (hash.length() == 0)
         {
-            delete calledCB;
+            sendQuery(uri, "", true, roz, expiry, expiryDelta,
+                      elaboratePAC, doNotVerify, leavePacked, on_result, deliverOn, handle);
+            return;
         }
+        sendQuery(uri, hash, false, {chain}, expiry, expiryDelta,
+                  elaboratePAC, doNotVerify, leavePacked, [=](QString error, PMessage m, bool final)
+        {
+            if (error.length() != 0)
+            {
+                drop();
+            }
+            on_result(error, m, final);
+        }, deliverOn, handle);
     });
 }
 
-void BW::buildAnyChain(QVariantMap params, QJSValue on_done)
+QThread* BW::deliveryThread(const MessageDelivery &delivery)
 {
-    QString uri = params["URI"].toString();
-    QString permissions = params["Permissions"].toString();
-    QString to = params["To"].toString();
-
-    this->buildAnyChain(uri, permissions, to, ERes<QString, SimpleChain*>(on_done));
+    switch (delivery.mode)
+    {
+    case MessageDelivery::Inline:
+        return nullptr;
+    case MessageDelivery::WorkerPool:
+        return WorkerPool::next();
+    case MessageDelivery::ContextThread:
+        Q_ASSERT(delivery.context != nullptr);
+        if (delivery.context != nullptr)
+        {
+            return delivery.context->thread();
+        }
+        break;
+    default:
+        break;
+    }
+    return this->thread();
 }
 
-void BW::query(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
-               QDateTime expiry, qreal expiryDelta, QString elaboratePAC,
-               bool doNotVerify, bool leavePacked,
-               Res<QString, PMessage, bool> on_result)
+void BW::sendQuery(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
+                   QDateTime expiry, qreal expiryDelta, QString elaboratePAC,
+                   bool doNotVerify, bool leavePacked,
+                   Res<QString, PMessage, bool> on_result, QThread *deliverOn,
+                   PTransactionHandle handle)
 {
-    auto f = agent()->newFrame(Frame::QUERY);
+    if (!handle.isNull() && handle->isCancelled())
+    {
+        return;
+    }
+    AgentConnection *conn = agentFor(uri);
+    auto f = conn->newFrame(Frame::QUERY);
     if (autoChain)
     {
         f->addHeader("autochain", "true");
@@ -842,7 +1601,7 @@ void BW::query(QString uri, QString primaryAccessChain, bool autoChain, QList<Ro
     }
     f->addHeader("doverify", doNotVerify ? "false": "true");
 
-    agent()->transact(this, f, [=](PFrame f, bool final)
+    conn->transactOn(deliverOn, f, [=](PFrame f, bool final)
     {
         if (f->isType(Frame::RESPONSE))
         {
@@ -853,7 +1612,7 @@ void BW::query(QString uri, QString primaryAccessChain, bool autoChain, QList<Ro
         }
 
         bool ok;
-        f->getHeaderS("from", &ok);
+        f->getHeaderS(Header::KeyFrom, &ok);
         if (ok)
         {
             on_result("", Message::fromFrame(f), final);
@@ -863,6 +1622,10 @@ void BW::query(QString uri, QString primaryAccessChain, bool autoChain, QList<Ro
             on_result("", PMessage(), true);
         }
     });
+    if (!handle.isNull())
+    {
+        handle->started(conn, f->seqno());
+    }
 }
 
 void BW::queryMsgPack(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
@@ -881,7 +1644,11 @@ void BW::queryMsgPack(QString uri, QString primaryAccessChain, bool autoChain, Q
             {
                 PayloadObject* po = *i;
                 QVariant v = MsgPack::unpack(po->contentArray());
-                on_result("", po->ponum(), v.toMap(), hascontent, final && i == pos.end());
+                on_result("", po->ponum(), v.toMap(), hascontent, final && i + 1 == pos.end());
+            }
+            if (final && pos.isEmpty())
+            {
+                on_result("", 0, QVariantMap(), false, true);
             }
         }
         else if (error.length() != 0 || final)
@@ -942,7 +1709,11 @@ void BW::queryText(QString uri, QString primaryAccessChain, bool autoChain, QLis
             for (auto i = pos.begin(); i != pos.end(); i++)
             {
                 PayloadObject* po = *i;
-                on_result("", po->ponum(), QString(po->contentArray()), hascontent, final && i == pos.end());
+                on_result("", po->ponum(), textContent(po), hascontent, final && i + 1 == pos.end());
+            }
+            if (final && pos.isEmpty())
+            {
+                on_result("", 0, QString(), false, true);
             }
         }
         else if (error.length() != 0 || final)
@@ -1038,27 +1809,41 @@ void BW::queryOne(QString uri, QString primaryAccessChain, bool autoChain, QList
                   QDateTime expiry, qreal expiryDelta, QString elaboratePAC,
                   bool doNotVerify, bool leavePacked, Res<QString, PMessage> on_done)
 {
-    bool* fired = new bool;
-    *fired = false;
+    //The rest of the results are not wanted once the first is in
+    PTransactionHandle handle(new TransactionHandle());
+    QSharedPointer<bool> fired(new bool(false));
 
-    this->query(uri, primaryAccessChain, autoChain, roz, expiry, expiryDelta, elaboratePAC,
-                doNotVerify, leavePacked, [=](QString error, PMessage msg, bool final)
+    startQuery(uri, primaryAccessChain, autoChain, roz, expiry, expiryDelta, elaboratePAC,
+               doNotVerify, leavePacked, [=](QString error, PMessage msg, bool final)
     {
-        if (!*fired && msg != nullptr)
+        if (*fired || (error.length() == 0 && msg == nullptr && !final))
+        {
+            return;
+        }
+        *fired = true;
+        if (!final)
         {
-            on_done(error, msg);
-            *fired = true;
+            handle->cancel();
         }
+        on_done(error, msg);
+    }, this->thread(), handle);
+}
 
-        if (final)
+QueryStream* BW::queryStream(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
+                             QDateTime expiry, qreal expiryDelta, QString elaboratePAC,
+                             bool doNotVerify, bool leavePacked, int limit, int bufferSize)
+{
+    QueryStream *stream = new QueryStream(limit, bufferSize);
+    QPointer<QueryStream> target(stream);
+    startQuery(uri, primaryAccessChain, autoChain, roz, expiry, expiryDelta, elaboratePAC,
+               doNotVerify, leavePacked, [target](QString error, PMessage msg, bool final)
+    {
+        if (!target.isNull())
         {
-            if (!*fired)
-            {
-                on_done("", PMessage());
-            }
-            delete fired;
+            target->onResult(error, msg, final);
         }
-    });
+    }, stream->thread(), stream->m_handle);
+    return stream;
 }
 
 void BW::list(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
@@ -1103,7 +1888,7 @@ void BW::list(QString uri, QString primaryAccessChain, bool autoChain, QList<Rou
         if (f->checkResponse(on_result, QStringLiteral(""), true))
         {
             bool ok;
-            QString child = f->getHeaderS("child", &ok);
+            QString child = f->getHeaderS(Header::KeyChild, &ok);
             if (ok || final)
             {
                 on_result("", child, final);
@@ -1149,7 +1934,7 @@ void BW::list(QVariantMap params, QJSValue on_result)
 void BW::publishDOTWithAcc(QByteArray blob, int account, Res<QString, QString> on_done)
 {
     auto f = agent()->newFrame(Frame::PUT_DOT);
-    PayloadObject* po = PayloadObject::load(bwpo::num::ROAccessDOT, blob.constData(), blob.size());
+    PayloadObject* po = createBasePayloadObject(bwpo::num::ROAccessDOT, blob);
     f->addPayloadObject(po);
     f->addHeader("account", QString::number(account));
 
@@ -1157,7 +1942,7 @@ void BW::publishDOTWithAcc(QByteArray blob, int account, Res<QString, QString> o
     {
         if (f->checkResponse(on_done, QStringLiteral("")))
         {
-            QString hash = f->getHeaderS("hash");
+            QString hash = f->getHeaderS(Header::KeyHash);
             on_done("", hash);
         }
     });
@@ -1182,7 +1967,7 @@ void BW::publishEntityWithAcc(QByteArray blob, int account,
                               Res<QString, QString> on_done)
 {
     auto f = agent()->newFrame(Frame::PUT_ENTITY);
-    PayloadObject* po = PayloadObject::load(bwpo::num::ROEntity, blob.constData(), blob.size());
+    PayloadObject* po = createBasePayloadObject(bwpo::num::ROEntity, blob);
     f->addPayloadObject(po);
     f->addHeader("account", QString::number(account));
 
@@ -1190,7 +1975,7 @@ void BW::publishEntityWithAcc(QByteArray blob, int account,
     {
         if (f->checkResponse(on_done, QStringLiteral("")))
         {
-            QString hash = f->getHeaderS("vk");
+            QString hash = f->getHeaderS(Header::KeyVK);
             on_done("", hash);
         }
     });
@@ -1214,6 +1999,7 @@ void BW::publishEntity(QByteArray blob, QJSValue on_done)
 void BW::setMetadata(QString uri, QString key, QString val, Res<QString> on_done)
 {
     MetadataTuple metadata(val, QDateTime::currentMSecsSinceEpoch() * Q_INT64_C(1000000));
+    on_done = invalidatingMetadata(uri, on_done);
 
     if (uri.endsWith(QStringLiteral("/")))
     {
@@ -1232,6 +2018,7 @@ void BW::setMetadata(QString uri, QString key, QString val, QJSValue on_done)
 
 void BW::delMetadata(QString uri, QString key, Res<QString> on_done)
 {
+    on_done = invalidatingMetadata(uri, on_done);
     if (uri.endsWith(QStringLiteral("/")))
     {
         uri.chop(1);
@@ -1247,92 +2034,31 @@ void BW::delMetadata(QString uri, QString key, QJSValue on_done)
     this->delMetadata(uri, key, ERes<QString>(on_done));
 }
 
-struct metadata_kv
+Res<QString> BW::invalidatingMetadata(QString uri, Res<QString> on_done)
 {
-    QString k;
-    MetadataTuple m;
-    QString o;
-};
-
-struct metadata_info
-{
-    QVector<struct metadata_kv> chans;
-    int numreturned;
-    int errorhappened;
-};
+    //Once the agent has taken the change, our copy of that prefix is stale
+    return [this, uri, on_done](QString error)
+    {
+        if (error.length() == 0)
+        {
+            m_metadata->invalidate(uri);
+        }
+        on_done(error);
+    };
+}
 
 void BW::getMetadata(QString uri, Res<QString, QMap<QString, MetadataTuple>, QMap<QString, QString>> on_done)
 {
-    QStringList parts = uri.split('/', QString::SkipEmptyParts);
-    QString turi("");
-
-    struct metadata_info* mi = new struct metadata_info;
-    mi->chans.resize(parts.size());
-    mi->numreturned = 0;
-    mi->errorhappened = false;
-
-    int li = 0;
-    for (auto i = parts.begin(); i != parts.end(); i++)
+    if (QThread::currentThread() != this->thread())
     {
-        turi += *i;
-        turi += "/";
-
-        QString touse(turi);
-        touse += "!meta/";
-
-        this->queryList(touse, "", true, QList<RoutingObject*>(), QDateTime(), -1, "",
-                        false, false, [=](QString error, QList<PMessage> messages)
+        //The metadata cache is only touched on our thread
+        ThreadDispatcher::forThread(this->thread())->post([=]
         {
-
-            if (error.length() != 0)
-            {
-                on_done(error, QMap<QString, MetadataTuple>(), QMap<QString, QString>());
-                mi->errorhappened = true;
-            }
-            else
-            {
-                struct metadata_kv& metadata = mi->chans[li];
-
-                metadata.o = turi;
-                for (auto j = messages.begin(); j != messages.end(); j++)
-                {
-                    PMessage& sm = *j;
-                    QString uri = sm->getHeaderS("uri");
-                    QStringList uriparts = uri.split('/');
-                    metadata.k = uriparts.last();
-                    QList<PayloadObject*> pos = sm->FilterPOs(bwpo::num::SMetadata, bwpo::mask::SMetadata);
-                    for (auto k = pos.begin(); k != pos.end(); k++)
-                    {
-                        QVariant dictv = MsgPack::unpack((*k)->contentArray());
-                        QVariantMap dict = dictv.toMap();
-                        metadata.m = MetadataTuple(dict);
-                    }
-                }
-            }
-
-            if (++mi->numreturned == mi->chans.length())
-            {
-                if (!mi->errorhappened)
-                {
-                    /* Call on_done. */
-                    QMap<QString, QString> rvO;
-                    QMap<QString, MetadataTuple> rvM;
-
-                    for (auto res = mi->chans.begin(); res != mi->chans.end(); res++)
-                    {
-                        rvO[res->k] = res->o;
-                        rvM[res->k] = res->m;
-                    }
-
-                    on_done("", rvM, rvO);
-                }
-
-                delete mi;
-            }
+            getMetadata(uri, on_done);
         });
-
-        li++;
+        return;
     }
+    m_metadata->resolve(uri, on_done);
 }
 
 void BW::getMetadata(QString uri, QJSValue on_done)
@@ -1368,71 +2094,85 @@ void BW::getMetadataKey(QString uri, QString key, Res<QString, MetadataTuple, QS
         return;
     }
 
-    QStringList parts = uri.split('/', QString::SkipEmptyParts);
-    QString turi("");
-
-    struct metadata_info* mi = new struct metadata_info;
-    mi->chans.resize(parts.size());
-    mi->numreturned = 0;
-    mi->errorhappened = false;
+    if (QThread::currentThread() != this->thread())
+    {
+        ThreadDispatcher::forThread(this->thread())->post([=]
+        {
+            getMetadataKey(uri, key, on_done);
+        });
+        return;
+    }
 
-    int li = 0;
-    for (auto i = parts.begin(); i != parts.end(); i++)
+    //Every key at each prefix comes along anyway, and is cached for next time
+    m_metadata->resolve(uri, [=](QString error, QMap<QString, MetadataTuple> data, QMap<QString, QString> from)
     {
-        turi += *i;
-        turi += "/";
+        if (error.length() != 0)
+        {
+            on_done(error, MetadataTuple(), "");
+        }
+        else if (!data.contains(key))
+        {
+            on_done("", MetadataTuple(), "");
+        }
+        else
+        {
+            on_done("", data.value(key), from.value(key));
+        }
+    });
+}
 
-        QString touse(turi);
-        touse += "!meta/";
-        touse += key;
+void BW::setMetadataCacheTTL(int msecs)
+{
+    if (QThread::currentThread() != this->thread())
+    {
+        ThreadDispatcher::forThread(this->thread())->post([=]
+        {
+            setMetadataCacheTTL(msecs);
+        });
+        return;
+    }
+    m_metadata->setTtl(qMax(msecs, 0));
+}
 
-        this->queryOne(touse, "", true, QList<RoutingObject*>(), QDateTime(), -1, "",
-                       false, false, [=](QString error, PMessage message)
+void BW::setMetadataCacheLive(bool live)
+{
+    if (QThread::currentThread() != this->thread())
+    {
+        ThreadDispatcher::forThread(this->thread())->post([=]
         {
+            setMetadataCacheLive(live);
+        });
+        return;
+    }
+    m_metadata->setLive(live);
+}
 
-            if (error.length() != 0)
-            {
-                on_done(error, MetadataTuple(), "");
-                mi->errorhappened = true;
-            }
-            else
-            {
-                struct metadata_kv& metadata = mi->chans[li];
+void BW::clearMetadataCache()
+{
+    if (QThread::currentThread() != this->thread())
+    {
+        ThreadDispatcher::forThread(this->thread())->post([=]
+        {
+            clearMetadataCache();
+        });
+        return;
+    }
+    m_metadata->clear();
+}
 
-                metadata.k = key;
-                metadata.o = turi;
-                QList<PayloadObject*> pos = message->FilterPOs(bwpo::num::SMetadata, bwpo::mask::SMetadata);
-                for (auto k = pos.begin(); k != pos.end(); k++)
-                {
-                    QVariant dictv = MsgPack::unpack((*k)->contentArray());
-                    QVariantMap dict = dictv.toMap();
-                    metadata.m = MetadataTuple(dict);
-                }
-            }
+void BW::setResolveCacheTTL(ResolveKind kind, int msecs, int negativeMsecs)
+{
+    m_resolve->setTtl(kind, qMax(msecs, 0), qMax(negativeMsecs, 0));
+}
 
-            if (++mi->numreturned == mi->chans.length())
-            {
-                if (!mi->errorhappened)
-                {
-                    /* Call on_done. */
-
-                    for (auto res = mi->chans.rbegin(); res != mi->chans.rend(); res++)
-                    {
-                        if (res->k.length() != 0)
-                        {
-                            on_done("", res->m, res->o);
-                            goto end;
-                        }
-                    }
-                    on_done("", MetadataTuple(), "");
-                }
-        end:
-                delete mi;
-            }
-        });
+void BW::clearResolveCache()
+{
+    m_resolve->clear();
+}
 
-        li++;
-    }
+ResolveCacheStats BW::resolveCacheStats()
+{
+    return m_resolve->stats();
 }
 
 void BW::getMetadataKey(QString uri, QString key, QJSValue on_done)
@@ -1449,7 +2189,7 @@ void BW::getMetadataKey(QString uri, QString key, QJSValue on_done)
 void BW::publishChainWithAcc(QByteArray blob, int account, Res<QString, QString> on_done)
 {
     auto f = agent()->newFrame(Frame::PUT_CHAIN);
-    PayloadObject* po = PayloadObject::load(bwpo::num::ROAccessDChain, blob.constData(), blob.size());
+    PayloadObject* po = createBasePayloadObject(bwpo::num::ROAccessDChain, blob);
     f->addPayloadObject(po);
     f->addHeader("account", QString::number(account));
 
@@ -1457,7 +2197,7 @@ void BW::publishChainWithAcc(QByteArray blob, int account, Res<QString, QString>
     {
         if (f->checkResponse(on_done, QStringLiteral("")))
         {
-            QString hash = f->getHeaderS("vk");
+            QString hash = f->getHeaderS(Header::KeyVK);
             on_done("", hash);
         }
     });
@@ -1478,18 +2218,48 @@ void BW::publishChain(QByteArray blob, QJSValue on_done)
     this->publishChain(blob, ERes<QString, QString>(on_done));
 }
 
-void BW::unresolveAlias(QByteArray blob, Res<QString, QString> on_done)
+void BW::resolveCached(ResolveKind kind, QByteArray key, std::function<PFrame()> request,
+                       std::function<void(PFrame, ResolveResult*)> read,
+                       std::function<void(const ResolveResult&)> on_done)
 {
-    auto f = agent()->newFrame(Frame::RESOLVE_ALIAS);
-    f->addHeaderB("unresolve", blob);
-
-    agent()->transact(this, f, [=](PFrame f, bool)
+    m_resolve->lookup(kind, key, [=](ResolveCache::Done done)
     {
-        if (f->checkResponse(on_done, QStringLiteral("")))
+        agent()->transact(this, request(), [=](PFrame f, bool)
         {
-            QString v = f->getHeaderS("value");
-            on_done("", v);
-        }
+            ResolveResult r;
+            if (f->checkResponse(Res<QString>([&r](QString error) { r.error = error; })))
+            {
+                try
+                {
+                    read(f, &r);
+                }
+                catch (const BadRouterMessageException &e)
+                {
+                    //Everyone waiting on the lookup hears of it, not just us
+                    r.error = QString::fromLatin1(e.what());
+                    done(r);
+                    throw;
+                }
+            }
+            done(r);
+        });
+    }, on_done);
+}
+
+void BW::unresolveAlias(QByteArray blob, Res<QString, QString> on_done)
+{
+    resolveCached(ResolveUnresolveAlias, blob, [=]
+    {
+        auto f = agent()->newFrame(Frame::RESOLVE_ALIAS);
+        f->addHeaderB("unresolve", blob);
+        return f;
+    }, [](PFrame f, ResolveResult *r)
+    {
+        r->text = f->getHeaderS(Header::KeyValue);
+        r->found = r->text.length() != 0;
+    }, [=](const ResolveResult &r)
+    {
+        on_done(r.error, r.text);
     });
 }
 
@@ -1498,18 +2268,27 @@ void BW::unresolveAlias(QByteArray blob, QJSValue on_done)
     this->unresolveAlias(blob, ERes<QString, QString>(on_done));
 }
 
-void BW::resolveLongAlias(QString al, Res<QString, QByteArray, bool> on_done)
+static void readAliasValue(PFrame f, ResolveResult *r)
 {
-    auto f = agent()->newFrame(Frame::RESOLVE_ALIAS);
-    f->addHeader("longkey", al);
+    r->bytes = f->getHeaderB(Header::KeyValue);
+    r->found = r->bytes.count('\0') != r->bytes.size();
+}
 
-    agent()->transact(this, f, [=](PFrame f, bool)
+void BW::resolveLongAlias(QString al, Res<QString, QByteArray, bool> on_done)
+{
+    resolveCached(ResolveLongAlias, al.toUtf8(), [=]
     {
-        if (f->checkResponse(on_done, QByteArray(), false))
+        auto f = agent()->newFrame(Frame::RESOLVE_ALIAS);
+        f->addHeader("longkey", al);
+        return f;
+    }, readAliasValue, [=](const ResolveResult &r)
+    {
+        if (r.error.length() != 0)
         {
-            QByteArray v = f->getHeaderB("value");
-            on_done("", v, v.count('\0') == v.size());
+            on_done(r.error, QByteArray(), false);
+            return;
         }
+        on_done("", r.bytes, !r.found);
     });
 }
 
@@ -1520,16 +2299,19 @@ void BW::resolveLongAlias(QString al, QJSValue on_done)
 
 void BW::resolveShortAlias(QString al, Res<QString, QByteArray, bool> on_done)
 {
-    auto f = agent()->newFrame(Frame::RESOLVE_ALIAS);
-    f->addHeader("shortkey", al);
-
-    agent()->transact(this, f, [=](PFrame f, bool)
+    resolveCached(ResolveShortAlias, al.toUtf8(), [=]
+    {
+        auto f = agent()->newFrame(Frame::RESOLVE_ALIAS);
+        f->addHeader("shortkey", al);
+        return f;
+    }, readAliasValue, [=](const ResolveResult &r)
     {
-        if (f->checkResponse(on_done, QByteArray(), false))
+        if (r.error.length() != 0)
         {
-            QByteArray v = f->getHeaderB("value");
-            on_done("", v, v.count('\0') == v.size());
+            on_done(r.error, QByteArray(), false);
+            return;
         }
+        on_done("", r.bytes, !r.found);
     });
 }
 
@@ -1540,16 +2322,18 @@ void BW::resolveShortAlias(QString al, QJSValue on_done)
 
 void BW::resolveEmbeddedAlias(QString al, Res<QString, QString> on_done)
 {
-    auto f = agent()->newFrame(Frame::RESOLVE_ALIAS);
-    f->addHeader("longkey", al);
-
-    agent()->transact(this, f, [=](PFrame f, bool)
+    resolveCached(ResolveEmbeddedAlias, al.toUtf8(), [=]
     {
-        if (f->checkResponse(on_done, QStringLiteral("")))
-        {
-            QString v = f->getHeaderS("value");
-            on_done("", v);
-        }
+        auto f = agent()->newFrame(Frame::RESOLVE_ALIAS);
+        f->addHeader("longkey", al);
+        return f;
+    }, [](PFrame f, ResolveResult *r)
+    {
+        r->text = f->getHeaderS(Header::KeyValue);
+        r->found = r->text.length() != 0;
+    }, [=](const ResolveResult &r)
+    {
+        on_done(r.error, r.text);
     });
 }
 
@@ -1560,46 +2344,55 @@ void BW::resolveEmbeddedAlias(QString al, QJSValue on_done)
 
 void BW::resolveRegistry(QString key, Res<QString, RoutingObject*, RegistryValidity> on_done)
 {
-    auto f = agent()->newFrame(Frame::RESOLVE_REGISTRY);
-    f->addHeader("key", key);
-
-    agent()->transact(this, f, [=](PFrame f, bool)
+    resolveCached(ResolveRegistry, key.toUtf8(), [=]
+    {
+        auto f = agent()->newFrame(Frame::RESOLVE_REGISTRY);
+        f->addHeader("key", key);
+        return f;
+    }, [](PFrame f, ResolveResult *r)
     {
-        if (f->checkResponse(on_done, (RoutingObject*) nullptr, RegistryValidity::StateError))
+        QList<RoutingObject*> ros = f->getRoutingObjects();
+        if (ros.length() == 0)
         {
-            QList<RoutingObject*> ros = f->getRoutingObjects();
-            if (ros.length() == 0)
-            {
-                on_done("", nullptr, RegistryValidity::StateError);
-                return;
-            }
-            QString valid = f->getHeaderS("validity");
-            RegistryValidity validity;
+            return;
+        }
+        QString valid = f->getHeaderS(Header::KeyValidity);
 
-            if (valid == "valid")
-            {
-                validity = RegistryValidity::StateValid;
-            }
-            else if (valid == "expired")
-            {
-                validity = RegistryValidity::StateExpired;
-            }
-            else if (valid == "revoked")
-            {
-                validity = RegistryValidity::StateRevoked;
-            }
-            else if (valid == "unknown")
-            {
-                validity = RegistryValidity::StateUnknown;
-            }
-            else
-            {
-                std::string rawvalid = valid.toStdString();
-                throw BadRouterMessageException("Invalid \"validity\" value", rawvalid.data());
-            }
+        if (valid == "valid")
+        {
+            r->validity = RegistryValidity::StateValid;
+        }
+        else if (valid == "expired")
+        {
+            r->validity = RegistryValidity::StateExpired;
+        }
+        else if (valid == "revoked")
+        {
+            r->validity = RegistryValidity::StateRevoked;
+        }
+        else if (valid == "unknown")
+        {
+            r->validity = RegistryValidity::StateUnknown;
+        }
+        else
+        {
+            std::string rawvalid = valid.toStdString();
+            throw BadRouterMessageException("Invalid \"validity\" value", rawvalid.data());
+        }
 
-            on_done("", ros.first(), validity);
+        //The frame's objects go with it, so take a reference to the object
+        //from the shared cache it came out of
+        RoutingObject *ro = ros.first();
+        r->ro = RoutingObjectCache::global()->get(ro->ronum(), ro->content(), ro->length());
+        r->found = r->validity != RegistryValidity::StateUnknown;
+    }, [=](const ResolveResult &r)
+    {
+        if (r.error.length() != 0)
+        {
+            on_done(r.error, nullptr, RegistryValidity::StateError);
+            return;
         }
+        on_done("", r.ro.data(), r.validity);
     });
 }
 
@@ -1794,7 +2587,7 @@ void BW::newDesignatedRouterOffer(int account, QString nsvk, Entity* dr, Res<QSt
     if (dr != nullptr)
     {
         QByteArray sblob = dr->getSigningBlob();
-        PayloadObject* po = PayloadObject::load(bwpo::num::ROEntityWKey, sblob.data(), sblob.length());
+        PayloadObject* po = createBasePayloadObject(bwpo::num::ROEntityWKey, sblob);
         f->addPayloadObject(po);
     }
 
@@ -1820,7 +2613,7 @@ void BW::revokeDesignatedRouterOffer(int account, QString nsvk, Entity* dr, Res<
     if (dr != nullptr)
     {
         QByteArray sblob = dr->getSigningBlob();
-        PayloadObject* po = PayloadObject::load(bwpo::num::ROEntityWKey, sblob.data(), sblob.length());
+        PayloadObject* po = createBasePayloadObject(bwpo::num::ROEntityWKey, sblob);
         f->addPayloadObject(po);
     }
 
@@ -1846,7 +2639,7 @@ void BW::revokeAcceptanceOfDesignatedRouterOffer(int account, QString drvk, Enti
     if (ns != nullptr)
     {
         QByteArray sblob = ns->getSigningBlob();
-        PayloadObject* po = PayloadObject::load(bwpo::num::ROEntityWKey, sblob.data(), sblob.length());
+        PayloadObject* po = createBasePayloadObject(bwpo::num::ROEntityWKey, sblob);
         f->addPayloadObject(po);
     }
 
@@ -1873,7 +2666,7 @@ void BW::revokeEntity(QString vk, Res<QString, QString, QByteArray> on_done)
     {
         if (f->checkResponse(on_done, QStringLiteral(""), QByteArray()))
         {
-            QString hash = f->getHeaderS("hash");
+            QString hash = f->getHeaderS(Header::KeyHash);
             QList<PayloadObject*> pos = f->getPayloadObjects();
             if (pos.length() == 0)
             {
@@ -1899,7 +2692,7 @@ void BW::revokeDOT(QString hash, Res<QString, QString, QByteArray> on_done)
     {
         if (f->checkResponse(on_done, QStringLiteral(""), QByteArray()))
         {
-            QString hash = f->getHeaderS("hash");
+            QString hash = f->getHeaderS(Header::KeyHash);
             QList<PayloadObject*> pos = f->getPayloadObjects();
             if (pos.length() == 0)
             {
@@ -1919,7 +2712,7 @@ void BW::revokeDOT(QString hash, QJSValue on_done)
 void BW::publishRevocation(int account, QByteArray blob, Res<QString, QString> on_done)
 {
     auto f = agent()->newFrame(Frame::PUT_REVOCATION);
-    PayloadObject* po = PayloadObject::load(bwpo::num::RORevocation, blob.data(), blob.length());
+    PayloadObject* po = createBasePayloadObject(bwpo::num::RORevocation, blob);
     f->addPayloadObject(po);
     f->addHeader("account", QString::number(account));
 
@@ -1927,7 +2720,7 @@ void BW::publishRevocation(int account, QByteArray blob, Res<QString, QString> o
     {
         if (f->checkResponse(on_done, QStringLiteral("")))
         {
-            QString hash = f->getHeaderS("hash");
+            QString hash = f->getHeaderS(Header::KeyHash);
             on_done("", hash);
         }
     });
@@ -1975,7 +2768,7 @@ void BW::acceptDesignatedRouterOffer(int account, QString drvk, Entity* ns, Res<
     if (ns != nullptr)
     {
         QByteArray sblob = ns->getSigningBlob();
-        PayloadObject* po = PayloadObject::load(bwpo::num::ROEntityWKey, sblob.data(), sblob.length());
+        PayloadObject* po = createBasePayloadObject(bwpo::num::ROEntityWKey, sblob);
         f->addPayloadObject(po);
     }
 
@@ -2001,7 +2794,7 @@ void BW::setDesignatedRouterSRVRecord(int account, QString srv, Entity* dr, Res<
     if (dr != nullptr)
     {
         QByteArray sblob = dr->getSigningBlob();
-        PayloadObject* po = PayloadObject::load(bwpo::num::ROEntityWKey, sblob.data(), sblob.length());
+        PayloadObject* po = createBasePayloadObject(bwpo::num::ROEntityWKey, sblob);
         f->addPayloadObject(po);
     }
 
@@ -2051,11 +2844,18 @@ QString BW::getVK()
 }
 
 void BW::createView(QVariantMap query, Res<QString, BWView*> on_done)
+{
+    BWView* rv = new BWView(this);
+    rv->m_query = query;
+    m_views.append(rv);
+    openView(rv, on_done);
+}
+
+void BW::openView(BWView *rv, Res<QString, BWView*> on_done)
 {
     auto f = agent()->newFrame(Frame::MAKE_VIEW);
-    QByteArray mpo = MsgPack::pack(query);
+    QByteArray mpo = MsgPack::pack(rv->m_query);
     f->addHeaderB("msgpack",mpo);
-    BWView* rv = new BWView(this);
     agent()->transact(this, f, [=](PFrame f, bool)
     {
         if (f->isType(Frame::RESPONSE))
@@ -2063,7 +2863,7 @@ void BW::createView(QVariantMap query, Res<QString, BWView*> on_done)
             if(f->checkResponse(on_done, (BWView*)nullptr))
             {
                 qDebug() << "invoking nil reply";
-                rv->m_vid = f->getHeaderI("id");
+                rv->m_vid = f->getHeaderI(Header::KeyID);
                 on_done("", rv);
                 rv->onChange();
             }
@@ -2072,7 +2872,7 @@ void BW::createView(QVariantMap query, Res<QString, BWView*> on_done)
         {
             rv->onChange();
         }
-    });
+    }, true);
 }
 
 void BW::createView(QVariantMap query, QJSValue on_done)
@@ -2092,6 +2892,12 @@ void BWView::onChange()
     f->addHeader("id",QString::number(m_vid));
     bw->agent()->transact(this, f, [=](PFrame f, bool)
     {
+        //The connection went before the answer came, the view is listed
+        //again once it is restored
+        if (f->isType(Frame::RESPONSE) && !f->checkResponse(Res<QString>()))
+        {
+            return;
+        }
         //This view has changed (the interfaces in it have changed)
         //tODO handle M
         auto m = Message::fromFrame(f);
@@ -2129,3 +2935,107 @@ const QVariantList& BWView::interfaces()
 {
     return m_interfaces;
 }
+
+QueryStream::QueryStream(int limit, int bufferSize)
+    : QObject(nullptr), m_handle(new TransactionHandle()), m_limit(qMax(limit, 0)),
+      m_bufferSize(qMax(bufferSize, 1)), m_received(0), m_finished(false)
+{
+}
+
+QueryStream::~QueryStream()
+{
+    m_handle->cancel();
+}
+
+bool QueryStream::next(PMessage *out)
+{
+    if (m_buffer.isEmpty())
+    {
+        return false;
+    }
+    *out = m_buffer.dequeue();
+    return true;
+}
+
+int QueryStream::available() const
+{
+    return m_buffer.size();
+}
+
+bool QueryStream::isFinished() const
+{
+    return m_finished;
+}
+
+bool QueryStream::atEnd() const
+{
+    return m_finished && m_buffer.isEmpty();
+}
+
+QString QueryStream::error() const
+{
+    return m_error;
+}
+
+int QueryStream::received() const
+{
+    return m_received;
+}
+
+void QueryStream::cancel()
+{
+    m_handle->cancel();
+    m_buffer.clear();
+    m_finished = true;
+}
+
+void QueryStream::onResult(QString error, PMessage m, bool final)
+{
+    if (m_finished)
+    {
+        //Sent before the query was stopped
+        return;
+    }
+    if (error.length() != 0)
+    {
+        finish(error);
+        return;
+    }
+    if (m.isNull())
+    {
+        if (final)
+        {
+            finish("");
+        }
+        return;
+    }
+    if (m_buffer.size() >= m_bufferSize)
+    {
+        m_handle->cancel();
+        finish("query results were not taken fast enough");
+        return;
+    }
+    m_buffer.enqueue(m);
+    m_received++;
+    bool done = final || (m_limit > 0 && m_received >= m_limit);
+    if (done && !final)
+    {
+        m_handle->cancel();
+    }
+    if (done)
+    {
+        m_finished = true;
+    }
+    emit readyRead();
+    if (done)
+    {
+        emit finished();
+    }
+}
+
+void QueryStream::finish(QString error)
+{
+    m_finished = true;
+    m_error = error;
+    emit finished();
+}
@@ -6,21 +6,105 @@
 #include <QTimer>
 #include <QJSValueList>
 #include <QSharedPointer>
+#include <QMutex>
+#include <QQueue>
+#include <QHash>
+#include <QMap>
+#include <QPointer>
+#include <QVector>
 
 #include "utils.h"
 #include "agentconnection.h"
 #include "message.h"
+#include "msgpackschema.h"
+#include "allocations.h"
 
 QT_FORWARD_DECLARE_CLASS(MetadataTuple)
+QT_FORWARD_DECLARE_CLASS(MetadataCache)
+QT_FORWARD_DECLARE_CLASS(ResolveCache)
+QT_FORWARD_DECLARE_STRUCT(ResolveResult)
 QT_FORWARD_DECLARE_CLASS(BalanceInfo)
 QT_FORWARD_DECLARE_CLASS(SimpleChain)
 QT_FORWARD_DECLARE_CLASS(BWView)
+QT_FORWARD_DECLARE_CLASS(QueryStream)
 
 const QString elaborateDefault("");
 const QString elaborateFull("full");
 const QString elaboratePartial("partial");
 const QString elaborateNone("none");
 
+/**
+ * @brief Publish counters, as returned by BW::publishStats()
+ *
+ * @ingroup cpp
+ * @since 1.5
+ */
+struct PublishStats
+{
+    PublishStats()
+        : sent(0), acknowledged(0), failed(0), unacknowledged(0),
+          inFlight(0), queued(0) {}
+    /// Publishes handed to the agent connection that expect a response
+    quint64 sent;
+    /// Publishes the agent confirmed
+    quint64 acknowledged;
+    /// Publishes the agent rejected
+    quint64 failed;
+    /// Publishes sent in PublishNoAck mode
+    quint64 unacknowledged;
+    /// Windowed publishes awaiting their response
+    int inFlight;
+    /// Windowed publishes waiting for room in the window
+    int queued;
+};
+
+/**
+ * @brief Alias and registry cache counters, as returned by BW::resolveCacheStats()
+ *
+ * @ingroup cpp
+ * @since 1.5
+ */
+struct ResolveCacheStats
+{
+    ResolveCacheStats()
+        : hits(0), negativeHits(0), misses(0), coalesced(0), entries(0) {}
+    /// Lookups answered from the cache
+    quint64 hits;
+    /// Of those, lookups answered with a cached "not found"
+    quint64 negativeHits;
+    /// Lookups that went to the agent
+    quint64 misses;
+    /// Lookups that waited on another lookup of the same key
+    quint64 coalesced;
+    /// Keys cached or being looked up
+    int entries;
+};
+
+/**
+ * @brief Where the C++ callbacks of a subscription or query run, see BW::subscribe() and BW::query()
+ *
+ * @ingroup cpp
+ * @since 1.5
+ */
+struct MessageDelivery
+{
+    enum Mode
+    {
+        /// On the thread the BW object lives in, usually the GUI thread
+        BWThread = 0,
+        /// On the agent connection's I/O thread as soon as the message is parsed. Nothing else on that connection moves until the callback returns
+        Inline = 1,
+        /// On a shared pool of worker threads. A subscription or query keeps to one of them, so its messages still arrive one at a time and in order
+        WorkerPool = 2,
+        /// On the thread that context lives in
+        ContextThread = 3
+    };
+    MessageDelivery(Mode mode = BWThread, QObject *context = nullptr)
+        : mode(mode), context(context) {}
+    Mode mode;
+    QObject *context;
+};
+
 
 /*! \mainpage BOSSWAVE Wavelet Viewer
  *
@@ -85,6 +169,34 @@ public:
     };
     Q_ENUM(RegistryValidity)
 
+    enum PublishMode
+    {
+        /// Every publish waits for its own response, nothing limits how many are outstanding
+        PublishAcked = 0,
+        /// Like PublishAcked, but at most publishWindow() publishes are in flight and the rest queue
+        PublishWindowed = 1,
+        /// Fire and forget, no response is tracked and on_done is called once the frame is queued
+        PublishNoAck = 2
+    };
+    Q_ENUM(PublishMode)
+
+    enum ResolveKind
+    {
+        /// resolveLongAlias
+        ResolveLongAlias = 0,
+        /// resolveShortAlias
+        ResolveShortAlias = 1,
+        /// resolveEmbeddedAlias
+        ResolveEmbeddedAlias = 2,
+        /// unresolveAlias
+        ResolveUnresolveAlias = 3,
+        /// resolveRegistry
+        ResolveRegistry = 4,
+        /// Access chains built in place of autochain for publish, subscribe and query
+        ResolveAccessChain = 5
+    };
+    Q_ENUM(ResolveKind)
+
     // This is used by the QML engine to instantiate the bosswave singleton
     static QObject *qmlSingleton(QQmlEngine *engine, QJSEngine *scriptEngine);
 
@@ -117,11 +229,79 @@ public:
      * and the entity must be set again. agentConnected() will be signalled
      * when this process is complete
      *
+     * If the connection is lost later on, or cannot be made, it is tried
+     * again after a short delay that grows (with some randomness) up to 30
+     * seconds between attempts. agentChanged() reports the loss and the
+     * recovery. Once back, the entity last set is set again, requests made
+     * in the meantime are sent (unless they ran out of time first, see
+     * setRequestTimeout()), and subscriptions and views are made again.
+     * Subscribers keep their handles. Requests that were waiting for a
+     * response when the connection went fail with an error. Subscriptions
+     * made with routing objects, an expiry or a MessageDelivery other than
+     * BWThread are not restored, and subscriptionLost() is fired for them,
+     * as it is for one that cannot be made again. See setAgentHeartbeat()
+     * for how a silent agent is noticed.
+     *
+     * See setAgentConnections() for spreading the traffic over more than one
+     * connection.
+     *
      * @ingroup cpp
      * @since 1.4
      */
     void connectAgent(QByteArray &ourentity);
 
+    /**
+     * @brief Set how a connection to an agent that stopped responding is detected
+     * @param msecs After this many milliseconds without hearing from the agent it is sent a request, and if another period passes without a word the connection is dropped and made again. 0 turns this off. The default is 5000
+     *
+     * @ingroup cpp
+     * @ingroup qml
+     * @since 1.5
+     */
+    Q_INVOKABLE void setAgentHeartbeat(int msecs);
+
+    /**
+     * @brief Set how long a request may wait on the agent before it fails
+     * @param msecs The most milliseconds allowed between the request and its response, and between one result and the next. 0 waits for ever. The default is 60000
+     *
+     * A request that runs out of time gets an error, the same way it would
+     * if the connection were lost, and whatever the agent sends for it
+     * afterwards is dropped. Subscriptions and views are only timed until
+     * their first answer, after which they may be quiet for as long as they
+     * like. Requests already waiting keep the time they started with.
+     *
+     * @ingroup cpp
+     * @ingroup qml
+     * @since 1.5
+     */
+    Q_INVOKABLE void setRequestTimeout(int msecs);
+
+    /**
+     * @brief Set how many connections to the agent connectAgent() makes
+     * @param count The number of connections, each with its own thread. The default is 1
+     *
+     * Publishes, subscriptions and queries go over the connection picked by
+     * a hash of their URI, so those for one URI stay in order while a large
+     * publish on one URI does not hold up traffic on the others. Everything
+     * else uses the first connection, which is also the one agentChanged()
+     * reports on. The entity is set on all of them. This takes effect the
+     * next time connectAgent() is called.
+     *
+     * @ingroup cpp
+     * @ingroup qml
+     * @since 1.5
+     */
+    Q_INVOKABLE void setAgentConnections(int count);
+
+    /**
+     * @brief Get the agent connection counters, including how long recovering from outages took
+     * @return A snapshot of the counters, summed over all connections. lastRecoveryMsecs is the longest of them
+     *
+     * @ingroup cpp
+     * @since 1.5
+     */
+    ConnectionStats connectionStats();
+
     /**
      * @brief Create a new entity
      * @param expiry The time at which the entity expires. Ignored if invalid (year == 0)
@@ -220,6 +400,7 @@ public:
      * @param doNotVerify If false, the router will verify this message as if it were hostile
      * @param persist If true, the message is persisted
      * @param on_done The callback that is executed when the publish process is complete. Takes one argument: an error message, or the empty string if there was no error
+     * @param mode How the publish is acknowledged, see PublishMode
      *
      * @ingroup cpp
      * @since 1.4
@@ -227,7 +408,8 @@ public:
     void publish(QString uri, QString primaryAccessChain, bool autoChain,
                  QList<RoutingObject*> roz, QList<PayloadObject*> poz,
                  QDateTime expiry, qreal expiryDelta, QString elaboratePAC, bool doNotVerify,
-                 bool persist, Res<QString> on_done = _nop_res_status);
+                 bool persist, Res<QString> on_done = _nop_res_status,
+                 PublishMode mode = PublishAcked);
 
     /**
      * @brief Publish a MsgPack object to a resource
@@ -243,6 +425,7 @@ public:
      * @param doNotVerify If false, the router will verify this message as if it were hostile
      * @param persist If true, the message is persisted
      * @param on_done The callback that is executed when the publish process is complete. Takes one argument: an error message, or the empty string if there was no error
+     * @param mode How the publish is acknowledged, see PublishMode
      *
      * @ingroup cpp
      * @since 1.4
@@ -250,11 +433,12 @@ public:
     void publishMsgPack(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
                         int ponum, QVariantMap val, QDateTime expiry, qreal expiryDelta,
                         QString elaboratePAC, bool doNotVerify, bool persist,
-                        Res<QString> on_done = _nop_res_status);
+                        Res<QString> on_done = _nop_res_status,
+                        PublishMode mode = PublishAcked);
 
     /**
      * @brief Publish a MsgPack object to a resource
-     * @param params A map of parameters. Keys are: (1) URI, (2) PrimaryAccessChain, (3) AutoChain, (4) RoutingObjects, (5) Payload, (6) PONum, (7) Expiry, (8) ExpiryDelta, (9) ElaboratePAC, (10) DoNotVerify, and (11) Persist
+     * @param params A map of parameters. Keys are: (1) URI, (2) PrimaryAccessChain, (3) AutoChain, (4) RoutingObjects, (5) Payload, (6) PONum, (7) Expiry, (8) ExpiryDelta, (9) ElaboratePAC, (10) DoNotVerify, (11) Persist, and (12) Mode
      * @param on_done Javascript callback invoked at the end of the publish process with one argument: an error message, or the empty string if no error occurred
      *
      * @ingroup qml
@@ -276,6 +460,7 @@ public:
      * @param doNotVerify If false, the router will verify this message as if it were hostile
      * @param persist If true, the message is persisted
      * @param on_done The callback that is executed when the publish process is complete. Takes one argument: an error message, or the empty string if there was no error
+     * @param mode How the publish is acknowledged, see PublishMode
      *
      * @ingroup cpp
      * @since 1.4
@@ -283,11 +468,12 @@ public:
     void publishText(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
                      int ponum, QString msg, QDateTime expiry, qreal expiryDelta,
                      QString elaboratePAC, bool doNotVerify, bool persist,
-                     Res<QString> on_done = _nop_res_status);
+                     Res<QString> on_done = _nop_res_status,
+                     PublishMode mode = PublishAcked);
 
     /**
      * @brief Publish text to a resource
-     * @param params A map of parameters. Keys are: (1) URI, (2) PrimaryAccessChain, (3) AutoChain, (4) RoutingObjects, (5) Payload, (6) PONum, (7) Expiry, (8) ExpiryDelta, (9) ElaboratePAC, (10) DoNotVerify, and (11) Persist
+     * @param params A map of parameters. Keys are: (1) URI, (2) PrimaryAccessChain, (3) AutoChain, (4) RoutingObjects, (5) Payload, (6) PONum, (7) Expiry, (8) ExpiryDelta, (9) ElaboratePAC, (10) DoNotVerify, (11) Persist, and (12) Mode
      * @param on_done Javascript callback invoked at the end of the publish process with one argument: an error message, or the empty string if no error occurred
      *
      * @ingroup qml
@@ -297,6 +483,21 @@ public:
 
     /**
      * @brief Subscribe to a resource
+     *
+     * Identical subscriptions (same URI, access chain, autochain,
+     * elaboration, verification and unpacking) made through this BW object
+     * share one subscription at the agent, so each message is received and
+     * parsed once and then handed to every listener. Each call still gets its
+     * own handle, and the agent subscription is only dropped when the last of
+     * them is unsubscribed. Subscriptions with routing objects or an expiry
+     * are never shared.
+     *
+     * on_msg runs where delivery says. Anywhere but the BW thread the
+     * subscription is not shared, nor made again after the agent connection
+     * is lost (subscriptionLost() says when it is), and its first messages
+     * may arrive before on_done is called.
+     * Called from another thread, the subscription is made on the BW thread.
+     *
      * @param uri The resource to subscribe to
      * @param primaryAccessChain The Primary Access Chain to use
      * @param autoChain If true, the DOT chain is inferred automatically
@@ -308,6 +509,7 @@ public:
      * @param leavePacked If true, the POs and ROs are left in the bosswave format
      * @param on_msg The callback that is executed when a message is received
      * @param on_done The callback that is executed when the subscribe process is complete. First argument is an error message, or the empty string if no error occurred. Second argument is the subscription handle.
+     * @param delivery Where on_msg runs (since 1.5). on_done always runs on the BW thread
      *
      * @ingroup cpp
      * @since 1.4
@@ -315,7 +517,8 @@ public:
     void subscribe(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
                    QDateTime expiry, qreal expiryDelta, QString elaboratePAC,
                    bool doNotVerify, bool leavePacked, Res<PMessage> on_msg,
-                   Res<QString, QString> on_done = _nop_res_status2);
+                   Res<QString, QString> on_done = _nop_res_status2,
+                   MessageDelivery delivery = MessageDelivery());
 
     /**
      * @brief Subscribe to a MsgPack resource
@@ -350,6 +553,45 @@ public:
      */
     Q_INVOKABLE void subscribeMsgPack(QVariantMap params, QJSValue on_msg, QJSValue on_done);
 
+    /**
+     * @brief Subscribe to a MsgPack resource and decode each message into a struct
+     * @param uri The resource to subscribe to
+     * @param primaryAccessChain The Primary Access Chain to use
+     * @param autoChain If true, the DOT chain is inferred automatically
+     * @param roz Routing objects to include in the message
+     * @param expiry The time at which the message should expire (ignored if invalid)
+     * @param expiryDelta The number of milliseconds after which the message should expire (ignored if negative)
+     * @param elaboratePAC Elaboration level for the Primary Access Chain
+     * @param doNotVerify If false, the router will verify this message as if it were hostile
+     * @param leavePacked If true, the POs and ROs are left in the bosswave format
+     * @param on_msg The callback that is executed when a message is received, with three arguments: (1) the PO number, (2) the decoded struct, and (3) which fields could not be decoded
+     * @param on_done The callback that is executed when the subscribe process is complete. First argument is an error message, or the empty string if no error occurred. Second argument is the subscription handle.
+     *
+     * T must have a schema declared with BW_MSGPACK_SCHEMA. Fields that are
+     * missing from a message keep their default value.
+     *
+     * @ingroup cpp
+     * @since 1.5
+     */
+    template <typename T>
+    void subscribeTyped(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
+                        QDateTime expiry, qreal expiryDelta, QString elaboratePAC,
+                        bool doNotVerify, bool leavePacked, Res<int, T, bwschema::DecodeResult> on_msg,
+                        Res<QString, QString> on_done = _nop_res_status2)
+    {
+        subscribe(uri, primaryAccessChain, autoChain, roz, expiry,
+                  expiryDelta, elaboratePAC, doNotVerify, leavePacked,
+                  [=](PMessage m)
+        {
+            foreach(auto po, m->FilterPOs(bwpo::num::MsgPack, bwpo::mask::MsgPack))
+            {
+                T v = T();
+                bwschema::DecodeResult res = bwschema::decode(po->content(), po->length(), v);
+                on_msg(po->ponum(), v, res);
+            }
+        }, on_done);
+    }
+
     /**
      * @brief Subscribe to a text resource
      * @param uri The resource to subscribe to
@@ -528,6 +770,7 @@ public:
      * @param doNotVerify If false, the router will verify this message as if it were hostile
      * @param leavePacked If true, the POs and ROs are left in the bosswave format
      * @param on_result Callback that is invoked multiple times. Takes three arguments: (1) error message, or the empty string if there was no error, (2) a persisted message or nullptr, (3) a boolean indicating whether all persisted messages have been delivered (in which case the callback will not be invoked again)
+     * @param delivery Where on_result runs (since 1.5)
      *
      * @ingroup cpp
      * @since 1.4
@@ -535,7 +778,8 @@ public:
     void query(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
                QDateTime expiry, qreal expiryDelta, QString elaboratePAC,
                bool doNotVerify, bool leavePacked,
-               Res<QString, PMessage, bool> on_result);
+               Res<QString, PMessage, bool> on_result,
+               MessageDelivery delivery = MessageDelivery());
 
     /**
      * @brief Query a resource for persisted MsgPack messages and decode them as MsgPack
@@ -568,6 +812,53 @@ public:
      */
     Q_INVOKABLE void queryMsgPack(QVariantMap params, QJSValue on_result);
 
+    /**
+     * @brief Query a resource for persisted MsgPack messages and decode them into a struct
+     * @param uri The resource to query
+     * @param primaryAccessChain The Primary Access Chain to use
+     * @param autoChain If true, the DOT chain is inferred automatically
+     * @param roz Routing objects to include in the message
+     * @param expiry The time at which the message should expire (ignored if invalid)
+     * @param expiryDelta The number of milliseconds after which the message should expire (ignored if negative)
+     * @param elaboratePAC Elaboration level for the Primary Access Chain
+     * @param doNotVerify If false, the router will verify this message as if it were hostile
+     * @param leavePacked If true, the POs and ROs are left in the bosswave format
+     * @param on_result Callback that is invoked multiple times. Takes six arguments: (1) error message, or the empty string if there was no error, (2) the payload object number of a persisted message, (3) the decoded struct, (4) which fields could not be decoded, (5) a boolean indicating whether a message is included in this invocation, and (6) a boolean indicating whether all persisted messages have been delivered (in which case the callback will not be invoked again)
+     *
+     * T must have a schema declared with BW_MSGPACK_SCHEMA.
+     *
+     * @ingroup cpp
+     * @since 1.5
+     */
+    template <typename T>
+    void queryTyped(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
+                    QDateTime expiry, qreal expiryDelta, QString elaboratePAC,
+                    bool doNotVerify, bool leavePacked,
+                    Res<QString, int, T, bwschema::DecodeResult, bool, bool> on_result)
+    {
+        query(uri, primaryAccessChain, autoChain, roz, expiry, expiryDelta,
+              elaboratePAC, doNotVerify, leavePacked, [=](QString error, PMessage message, bool final)
+        {
+            bool hascontent = (message != nullptr);
+            QList<PayloadObject*> pos;
+            if (error.length() == 0 && hascontent)
+            {
+                pos = message->FilterPOs(bwpo::num::MsgPack, bwpo::mask::MsgPack);
+            }
+            for (auto i = pos.begin(); i != pos.end(); i++)
+            {
+                PayloadObject* po = *i;
+                T v = T();
+                bwschema::DecodeResult res = bwschema::decode(po->content(), po->length(), v);
+                on_result("", po->ponum(), v, res, true, final && i + 1 == pos.end());
+            }
+            if (error.length() != 0 || (final && pos.isEmpty()))
+            {
+                on_result(error, 0, T(), bwschema::DecodeResult(), false, final);
+            }
+        });
+    }
+
     /**
      * @brief Query a resource for persisted text messages and decode them as text
      * @param uri The resource to query
@@ -640,6 +931,32 @@ public:
                   QDateTime expiry, qreal expiryDelta, QString elaboratePAC,
                   bool doNotVerify, bool leavePacked, Res<QString, PMessage> on_done);
 
+    /**
+     * @brief Query a resource for persisted messages, pulling the results from a stream
+     * @param uri The resource to query
+     * @param primaryAccessChain The Primary Access Chain to use
+     * @param autoChain If true, the DOT chain is inferred automatically
+     * @param roz Routing objects to include in the message
+     * @param expiry The time at which the message should expire (ignored if invalid)
+     * @param expiryDelta The number of milliseconds after which the message should expire (ignored if negative)
+     * @param elaboratePAC Elaboration level for the Primary Access Chain
+     * @param doNotVerify If false, the router will verify this message as if it were hostile
+     * @param leavePacked If true, the POs and ROs are left in the bosswave format
+     * @param limit Stop after this many results, 0 for all of them
+     * @param bufferSize The most results held for the caller to take at once
+     * @return The stream, which belongs to the caller
+     *
+     * Unlike queryList(), which holds every result until the last arrives,
+     * this only holds what has not been taken yet, so a large query runs in
+     * as much memory as the caller lets pile up.
+     *
+     * @ingroup cpp
+     * @since 1.5
+     */
+    QueryStream* queryStream(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
+                             QDateTime expiry, qreal expiryDelta, QString elaboratePAC,
+                             bool doNotVerify, bool leavePacked, int limit = 0, int bufferSize = 256);
+
     /**
      * @brief Lists all immediate children of a URI that have persisted messages in their children
      * @param uri The URI whose children to list
@@ -840,6 +1157,41 @@ public:
      */
     Q_INVOKABLE void getMetadataKey(QString uri, QString key, QJSValue on_done);
 
+    /**
+     * @brief Set how long fetched metadata is reused
+     * @param msecs Milliseconds before a URI prefix's metadata is fetched again. The default is 30000
+     *
+     * getMetadata and getMetadataKey share what they fetch for each prefix
+     * of a URI, so resolving sibling URIs queries the common prefixes once.
+     * Lookups of a prefix already being fetched wait for that fetch. 0
+     * fetches afresh for every lookup. Metadata set or deleted through
+     * this BW is dropped from the cache when the agent confirms it.
+     *
+     * @ingroup cpp
+     * @ingroup qml
+     * @since 1.5
+     */
+    Q_INVOKABLE void setMetadataCacheTTL(int msecs);
+
+    /**
+     * @brief Keep cached metadata current by subscribing to it
+     * @param live If true, each prefix fetched from now on is also subscribed to, and no longer expires
+     *
+     * @ingroup cpp
+     * @ingroup qml
+     * @since 1.5
+     */
+    Q_INVOKABLE void setMetadataCacheLive(bool live);
+
+    /**
+     * @brief Forget all cached metadata
+     *
+     * @ingroup cpp
+     * @ingroup qml
+     * @since 1.5
+     */
+    Q_INVOKABLE void clearMetadataCache();
+
     /**
      * @brief Publish a DOT chain using the specified account number
      * @param blob The DOT chain as a byte array
@@ -982,6 +1334,49 @@ public:
      */
     Q_INVOKABLE void resolveRegistry(QString key, QJSValue on_done);
 
+    /**
+     * @brief Set how long answers of one kind of alias or registry lookup are reused
+     * @param kind The lookup the TTLs apply to
+     * @param msecs Milliseconds an answer is reused for, 0 to not keep answers
+     * @param negativeMsecs Milliseconds a lookup that found nothing is remembered for
+     *
+     * The alias lookups and resolveRegistry keep their answers, and lookups
+     * of a key already being looked up wait for that lookup instead of
+     * asking the agent again. By default aliases are kept for ten minutes,
+     * access chains for five and registry answers for one, and lookups that
+     * found nothing for 15 seconds. Errors are never kept.
+     *
+     * Requests made with autoChain set, no primary access chain and no
+     * routing objects ask the agent to build the chain once per URI,
+     * permissions and entity, and send the cached chain along with later
+     * requests instead of having it build one each time. A request refused
+     * while using a cached chain drops it, so the next one builds a fresh
+     * one. Setting the ResolveAccessChain TTL to 0 goes back to autochain.
+     *
+     * @ingroup cpp
+     * @ingroup qml
+     * @since 1.5
+     */
+    Q_INVOKABLE void setResolveCacheTTL(ResolveKind kind, int msecs, int negativeMsecs);
+
+    /**
+     * @brief Forget all cached alias and registry answers
+     *
+     * @ingroup cpp
+     * @ingroup qml
+     * @since 1.5
+     */
+    Q_INVOKABLE void clearResolveCache();
+
+    /**
+     * @brief Get the alias and registry cache counters
+     * @return A snapshot of the counters
+     *
+     * @ingroup cpp
+     * @since 1.5
+     */
+    ResolveCacheStats resolveCacheStats();
+
     /**
      * @brief Get the balances of the current entity's bank accounts
      * @param on_done Callback invoked with two arguments: (1) an error message, or the empty string if there was no error, and (2) the balances of this entity's bank accounts
@@ -1354,6 +1749,39 @@ public:
      */
     Q_INVOKABLE void createView(QVariantMap query, QJSValue on_done);
 
+    /**
+     * @brief Set how many PublishWindowed publishes may await a response at once
+     * @param maxInFlight The window size, at least 1. The default is 64
+     *
+     * Publishes beyond the window are queued locally, in order, and sent as
+     * responses come back. publishBackpressure() reports when that starts
+     * and stops happening.
+     *
+     * @ingroup cpp
+     * @ingroup qml
+     * @since 1.5
+     */
+    Q_INVOKABLE void setPublishWindow(int maxInFlight);
+
+    /**
+     * @brief Get the PublishWindowed window size
+     * @return The maximum number of windowed publishes in flight
+     *
+     * @ingroup cpp
+     * @ingroup qml
+     * @since 1.5
+     */
+    Q_INVOKABLE int publishWindow();
+
+    /**
+     * @brief Get the publish counters
+     * @return A snapshot of the counters
+     *
+     * @ingroup cpp
+     * @since 1.5
+     */
+    PublishStats publishStats();
+
 signals:
     /**
      * @brief Fired when the BOSSWAVE agent connection changes (connect or disconnect)
@@ -1362,13 +1790,130 @@ signals:
      */
     void agentChanged(bool success, QString msg);
 
+    /**
+     * @brief Fired when the PublishWindowed window fills up, and again when the queue behind it has drained
+     * @param engaged True if publishes are being queued, false once they no longer are
+     */
+    void publishBackpressure(bool engaged);
+
+    /**
+     * @brief Fired when a subscription stops for good because the agent connection was lost
+     * @param handle The handle the subscription was given
+     * @param reason Why it could not be kept
+     *
+     * There is no need to unsubscribe from the handle afterwards.
+     */
+    void subscriptionLost(QString handle, QString reason);
+
 private:
     QQmlEngine *engine;
     QJSEngine *jsengine;
     AgentConnection *agent();
+    //The connection for traffic on uri
+    AgentConnection *agentFor(const QString &uri);
+    //The first of m_agents
     AgentConnection *m_agent;
+    QVector<AgentConnection*> m_agents;
+    int m_agentConnections;
+    int m_requestTimeout;
     QString m_vk;
 
+    //publish and query once the access chain is settled
+    void sendPublish(QString uri, QString primaryAccessChain, bool autoChain,
+                     QList<RoutingObject*> roz, QList<PayloadObject*> poz,
+                     QDateTime expiry, qreal expiryDelta, QString elaboratePAC, bool doNotVerify,
+                     bool persist, Res<QString> on_done, PublishMode mode);
+    void sendQuery(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
+                   QDateTime expiry, qreal expiryDelta, QString elaboratePAC,
+                   bool doNotVerify, bool leavePacked,
+                   Res<QString, PMessage, bool> on_result, QThread *deliverOn,
+                   PTransactionHandle handle);
+    //query, for a caller that may want to stop it early
+    void startQuery(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
+                    QDateTime expiry, qreal expiryDelta, QString elaboratePAC,
+                    bool doNotVerify, bool leavePacked,
+                    Res<QString, PMessage, bool> on_result, QThread *deliverOn,
+                    PTransactionHandle handle);
+    //buildChain, for a caller that may want to stop it early
+    void startBuildChain(QString uri, QString permissions, QString to,
+                         Res<QString, SimpleChain*, bool> on_done, PTransactionHandle handle);
+    //The thread callbacks go to for delivery, null for the I/O thread
+    QThread *deliveryThread(const MessageDelivery &delivery);
+    void publishWindowed(PFrame f, Res<QString> on_done);
+    void sendWindowed(PFrame f, Res<QString> on_done);
+    void onPublishDone(bool ok, bool windowed);
+    void pumpPublishQueue();
+    QMutex m_publishLock;
+    int m_publishWindow;
+    bool m_publishBackpressure;
+    PublishStats m_publishStats;
+    QQueue<QPair<PFrame, Res<QString>>> m_publishQueue;
+
+    //One agent subscription and the local listeners sharing it
+    struct SharedSubscription
+    {
+        SharedSubscription() : established(false), attempt(0) {}
+        QString key;
+        //What it was made with, to make it again after a reconnect
+        QString uri;
+        QString primaryAccessChain;
+        bool autoChain;
+        QString elaboratePAC;
+        bool doNotVerify;
+        bool leavePacked;
+        //The agent's handle, once it has answered
+        QString handle;
+        bool established;
+        QMap<quint64, Res<PMessage>> listeners;
+        //Listeners waiting for the agent's answer
+        QList<QPair<quint64, Res<QString, QString>>> pending;
+        //Bumped each time the agent is asked for it
+        int attempt;
+    };
+    typedef QSharedPointer<SharedSubscription> PSharedSubscription;
+    //A restorable subscription is dropped quietly with the agent connection,
+    //as it is made again once reconnected
+    void subscribeDirect(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
+                         QDateTime expiry, qreal expiryDelta, QString elaboratePAC,
+                         bool doNotVerify, bool leavePacked, Res<PMessage> on_msg,
+                         Res<QString, QString> on_done, bool restorable = false,
+                         MessageDelivery delivery = MessageDelivery());
+    void sendSubscribe(QString uri, QString primaryAccessChain, bool autoChain, QList<RoutingObject*> roz,
+                       QDateTime expiry, qreal expiryDelta, QString elaboratePAC,
+                       bool doNotVerify, bool leavePacked, Res<PMessage> on_msg,
+                       Res<QString, QString> on_done, bool restorable, QThread *deliverOn);
+    void subscribeShared(PSharedSubscription sub);
+    void onSharedSubscribeResponse(PSharedSubscription sub, QString err, QString handle);
+    void onSharedSubscribeMessage(PSharedSubscription sub, PMessage m);
+    void unsubscribeAgent(AgentConnection *conn, QString handle, Res<QString> on_done);
+    static QString sharedHandle(const QString &handle, quint64 id);
+    QHash<QString, PSharedSubscription> m_subscriptions;
+    //Local handle to the subscription and listener it names
+    QHash<QString, QPair<PSharedSubscription, quint64>> m_subscriptionHandles;
+    quint64 m_nextListener;
+    //The connection each direct subscription was made on, with more than one
+    QHash<QString, AgentConnection*> m_directHandles;
+    QList<QPointer<BWView>> m_views;
+    void openView(BWView *v, Res<QString, BWView*> on_done);
+    int m_agentHeartbeat;
+    void onAgentReconnected(AgentConnection *conn);
+
+    //Wraps on_done of a metadata change to drop the cached copy of uri
+    Res<QString> invalidatingMetadata(QString uri, Res<QString> on_done);
+    MetadataCache *m_metadata;
+
+    //Looks key up in m_resolve, sending the frame request() makes on a miss
+    //and filling the answer in with read() if the agent says okay
+    void resolveCached(ResolveKind kind, QByteArray key, std::function<PFrame()> request,
+                       std::function<void(PFrame, ResolveResult*)> read,
+                       std::function<void(const ResolveResult&)> on_done);
+    ResolveCache *m_resolve;
+    //Calls send with the cached access chain for uri, which it should send
+    //in place of autochain. The hash is empty if there is none to be had, and
+    //drop() should be called if a request using the chain is refused
+    void withAccessChain(QString uri, bool publish,
+                         std::function<void(QString hash, RoutingObject *chain, std::function<void()> drop)> send);
+
     template <typename ...Tz> Res<Tz...> ERes(QJSValue callback)
     {
         return Res<Tz...>(jsengine, callback);
@@ -1730,12 +2275,87 @@ signals:
 private:
     BW* bw;
     int m_vid;
+    //What it was made from, to make it again after a reconnect
+    QVariantMap m_query;
     QVariantList m_interfaces;
     QStringList m_services;
     void onChange();
     friend BW;
 };
 
+/**
+ * @brief The results of a query, as BW::queryStream() gives them
+ *
+ * Results are taken with next() as readyRead() announces them. Once the
+ * limit is reached, or the stream is cancelled or deleted, whatever else
+ * the agent sends for the query is skipped without being decoded. If more
+ * results are waiting than the buffer holds, the stream ends with an error
+ * instead of growing. Signals are emitted on the thread the stream was
+ * made on, and a stream should only be deleted from a slot with
+ * deleteLater().
+ *
+ * @ingroup cpp
+ * @since 1.5
+ */
+class QueryStream : public QObject
+{
+    Q_OBJECT
+
+public:
+    ~QueryStream();
+    /**
+     * @brief Take the next result
+     * @param out Set to the result
+     * @return False if there is none waiting
+     */
+    bool next(PMessage *out);
+    /**
+     * @brief The number of results waiting to be taken
+     */
+    int available() const;
+    /**
+     * @brief True once no more results will arrive
+     */
+    bool isFinished() const;
+    /**
+     * @brief True once no more results will arrive and all of them have been taken
+     */
+    bool atEnd() const;
+    /**
+     * @brief Why the query failed, or the empty string if it has not
+     */
+    QString error() const;
+    /**
+     * @brief The number of results received so far
+     */
+    int received() const;
+    /**
+     * @brief Stop the query and drop any results not taken yet. No signals follow
+     */
+    void cancel();
+signals:
+    /**
+     * @brief Fired when a result has arrived
+     */
+    void readyRead();
+    /**
+     * @brief Fired once no more results will arrive, see error()
+     */
+    void finished();
+private:
+    QueryStream(int limit, int bufferSize);
+    void onResult(QString error, PMessage m, bool final);
+    void finish(QString error);
+    PTransactionHandle m_handle;
+    int m_limit;
+    int m_bufferSize;
+    QQueue<PMessage> m_buffer;
+    int m_received;
+    bool m_finished;
+    QString m_error;
+    friend BW;
+};
+
 #endif // QTLIBBW_BOSSWAVE_H
 
 
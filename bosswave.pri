@@ -11,7 +11,14 @@ SOURCES += \
     $$PWD/bosswave.cpp \
     $$PWD/libbw.cpp \
     $$PWD/agentconnection.cpp \
+    $$PWD/frameparser.cpp \
+    $$PWD/timerwheel.cpp \
+    $$PWD/threaddispatcher.cpp \
     $$PWD/message.cpp \
+    $$PWD/msgpackschema.cpp \
+    $$PWD/routingobjectcache.cpp \
+    $$PWD/metadatacache.cpp \
+    $$PWD/resolvecache.cpp \
     $$PWD/crypto.cpp \
     $$PWD/ed25519/ed25519.c
 
@@ -21,8 +28,15 @@ HEADERS += \
     $$PWD/libbw.h \
     $$PWD/utils.h \
     $$PWD/agentconnection.h \
+    $$PWD/frameparser.h \
+    $$PWD/timerwheel.h \
+    $$PWD/threaddispatcher.h \
     $$PWD/allocations.h \
     $$PWD/message.h \
+    $$PWD/msgpackschema.h \
+    $$PWD/routingobjectcache.h \
+    $$PWD/metadatacache.h \
+    $$PWD/resolvecache.h \
     $$PWD/crypto.h
 
 include($$PWD/vendor/qmsgpack/qmsgpack.pri)
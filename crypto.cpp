@@ -1,5 +1,18 @@
 #include <ed25519/ed25519.h>
 #include <crypto.h>
+#include <threaddispatcher.h>
+
+#include <QAtomicInt>
+#include <QFile>
+#include <QRunnable>
+#include <QSharedPointer>
+#include <QThread>
+#include <QThreadPool>
+
+#include <cstring>
+#if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
+#include <QRandomGenerator>
+#endif
 
 void SignBlob(QByteArray &sk, QByteArray &vk, QByteArray *data, QByteArray *sig)
 {
@@ -24,10 +37,151 @@ QByteArray UnFmtKey(QByteArray &k)
 {
     return QByteArray::fromBase64(k,QByteArray::Base64UrlEncoding);
 }
+
+static void verifyRange(const QVector<VerifyItem> &items, int from, int to, bool *valid)
+{
+    int n = to - from;
+    QVector<const unsigned char*> m(n), pk(n), rs(n);
+    QVector<size_t> mlen(n);
+    QVector<int> ok(n);
+    int num = 0;
+    for (int i = from; i < to; i++)
+    {
+        const VerifyItem &it = items[i];
+        //Malformed keys or signatures fail without reaching ed25519
+        if (it.vk.length() != 32 || it.sig.length() != 64)
+        {
+            valid[i] = false;
+            continue;
+        }
+        m[num] = (const unsigned char*) it.data.constData();
+        mlen[num] = it.data.size();
+        pk[num] = (const unsigned char*) it.vk.constData();
+        rs[num] = (const unsigned char*) it.sig.constData();
+        num++;
+    }
+    if (num > 0)
+    {
+        ed25519_sign_open_batch(m.data(), mlen.data(), pk.data(), rs.data(), num, ok.data());
+    }
+    num = 0;
+    for (int i = from; i < to; i++)
+    {
+        const VerifyItem &it = items[i];
+        if (it.vk.length() == 32 && it.sig.length() == 64)
+        {
+            valid[i] = ok[num++] == 1;
+        }
+    }
+}
+
+bool VerifyBatch(const QVector<VerifyItem> &items, QVector<bool> *valid)
+{
+    QVector<bool> rv(items.size());
+    verifyRange(items, 0, items.size(), rv.data());
+    bool all = !rv.contains(false);
+    if (valid != nullptr)
+    {
+        *valid = qMove(rv);
+    }
+    return all;
+}
+
+namespace
+{
+//Enough per task that the batch code gets to work in full batches
+const int verifyChunk = 128;
+
+struct AsyncVerify
+{
+    QVector<VerifyItem> items;
+    QVector<bool> valid;
+    QAtomicInt remaining;
+    PThreadDispatcher dispatcher;
+    std::function<void(QVector<bool>)> on_done;
+};
+
+class VerifyTask : public QRunnable
+{
+public:
+    VerifyTask(QSharedPointer<AsyncVerify> job, int from, int to)
+        : m_job(job), m_from(from), m_to(to) {}
+
+    void run() override
+    {
+        //Tasks write disjoint ranges of valid
+        verifyRange(m_job->items, m_from, m_to, m_job->valid.data());
+        if (!m_job->remaining.deref())
+        {
+            auto job = m_job;
+            job->dispatcher->post([job]
+            {
+                job->on_done(job->valid);
+            });
+        }
+    }
+
+private:
+    QSharedPointer<AsyncVerify> m_job;
+    int m_from;
+    int m_to;
+};
+}
+
+void VerifyBatchAsync(QVector<VerifyItem> items, std::function<void(QVector<bool>)> on_done,
+                      QThreadPool *pool)
+{
+    if (pool == nullptr)
+    {
+        pool = QThreadPool::globalInstance();
+    }
+    auto job = QSharedPointer<AsyncVerify>::create();
+    job->items = qMove(items);
+    job->valid.resize(job->items.size());
+    job->dispatcher = ThreadDispatcher::forThread(QThread::currentThread());
+    job->on_done = on_done;
+    int n = job->items.size();
+    if (n == 0)
+    {
+        job->dispatcher->post([job]
+        {
+            job->on_done(job->valid);
+        });
+        return;
+    }
+    //No more tasks than threads, and none smaller than a chunk
+    int tasks = qBound(1, n / verifyChunk, qMax(1, pool->maxThreadCount()));
+    job->remaining.store(tasks);
+    for (int t = 0; t < tasks; t++)
+    {
+        pool->start(new VerifyTask(job, n * t / tasks, n * (t + 1) / tasks));
+    }
+}
+
+//Batch verification picks random scalars to combine the signatures, so
+//these have to be unpredictable
 void ed25519_randombytes_unsafe (void *p, size_t len)
 {
-    Q_UNUSED(p);
-    Q_UNUSED(len);
-    qFatal("you should not call this");
-    Q_UNREACHABLE();
+#if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
+    unsigned char *out = static_cast<unsigned char*>(p);
+    while (len >= sizeof(quint32))
+    {
+        quint32 r = QRandomGenerator::system()->generate();
+        memcpy(out, &r, sizeof(r));
+        out += sizeof(r);
+        len -= sizeof(r);
+    }
+    if (len > 0)
+    {
+        quint32 r = QRandomGenerator::system()->generate();
+        memcpy(out, &r, len);
+    }
+#else
+    QFile urandom(QStringLiteral("/dev/urandom"));
+    if (!urandom.open(QIODevice::ReadOnly | QIODevice::Unbuffered) ||
+        urandom.read(static_cast<char*>(p), len) != (qint64) len)
+    {
+        qFatal("no source of random bytes for ed25519");
+    }
+#endif
 }
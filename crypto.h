@@ -2,8 +2,32 @@
 #define CRYPTO_H
 #include <QByteArray>
 #include <QString>
+#include <QVector>
+#include <functional>
+
+QT_FORWARD_DECLARE_CLASS(QThreadPool)
+
 void SignBlob(QByteArray &sk, QByteArray &vk, QByteArray *data, QByteArray *sig);
 bool VerifyBlob(QByteArray &vk, QByteArray &sig, QByteArray &data);
 QString FmtKey(QByteArray &k);
 QByteArray UnFmtKey(QByteArray &k);
+
+//One signature to check: sig over data by vk
+struct VerifyItem
+{
+    QByteArray vk;
+    QByteArray sig;
+    QByteArray data;
+};
+
+//Checks many signatures at once, which is much cheaper per signature than
+//VerifyBlob on each. Returns true if all of them are good. If valid is
+//given it gets one entry per item, so a bad signature can be found.
+bool VerifyBatch(const QVector<VerifyItem> &items, QVector<bool> *valid = nullptr);
+//As above, with the items split across the threads of pool (the global
+//pool by default). on_done runs on the calling thread, which needs an
+//event loop. Items made with fromRawData, as RoutingObject::verifyItem
+//makes them, need what they point into kept alive until then.
+void VerifyBatchAsync(QVector<VerifyItem> items, std::function<void(QVector<bool>)> on_done,
+                      QThreadPool *pool = nullptr);
 #endif // CRYPTO_H
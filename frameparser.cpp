@@ -0,0 +1,347 @@
+#include "frameparser.h"
+#include "agentconnection.h"
+#include "message.h"
+#include "routingobjectcache.h"
+
+#include <QIODevice>
+
+#include <string.h>
+
+namespace
+{
+    //    4          15         26
+    //CMMD 10DIGITLEN 10DIGITSEQ\n
+    const int HeaderLength = 27;
+    //Object lines are short, anything longer than this is garbage
+    const int MaxLineLength = 256;
+    //For now do not support >16MB
+    const quint64 MaxObjectLength = 16*1024*1024;
+
+    bool parseDecimal(const char *p, const char *e, quint64 *out)
+    {
+        if (p == e || e - p > 19)
+            return false;
+        quint64 v = 0;
+        for (; p != e; ++p)
+        {
+            unsigned d = (unsigned char)(*p) - '0';
+            if (d > 9)
+                return false;
+            v = v*10 + d;
+        }
+        *out = v;
+        return true;
+    }
+}
+
+FrameParser::FrameParser()
+    : m_start(0), m_pos(0), m_state(ReadHeader), m_seqno(0), m_hint(0), m_cur(),
+      m_skip(false), m_skipFinishedKey(false), m_skipFinished(false)
+{
+    m_type[4] = 0;
+}
+
+void FrameParser::reset()
+{
+    m_buf = QByteArray();
+    m_start = 0;
+    m_pos = 0;
+    m_hint = 0;
+    m_state = ReadHeader;
+    m_items.resize(0);
+    //Sequence numbers do not outlive the stream
+    m_ignored.clear();
+    m_skip = false;
+}
+
+void FrameParser::ignore(quint32 seqno)
+{
+    if (m_state != ReadHeader && m_seqno == seqno)
+    {
+        //Halfway through one of its frames already
+        if (!m_skip)
+        {
+            m_skip = true;
+            m_skipFinished = false;
+            m_skipFinishedKey = false;
+            m_hint = 0;
+            for (int i = 0; i < m_items.size(); i++)
+            {
+                const Item &it = m_items.at(i);
+                if (it.kind == KV && it.keylen == 8 && memcmp(m_buf.constData() + it.keyoff, "finished", 8) == 0 &&
+                    it.length == 4 && memcmp(m_buf.constData() + it.off, "true", 4) == 0)
+                {
+                    m_skipFinished = true;
+                }
+            }
+            m_items.resize(0);
+            if (m_state == ReadBody)
+            {
+                m_skipFinishedKey = m_cur.kind == KV && m_cur.keylen == 8 &&
+                        memcmp(m_buf.constData() + m_cur.keyoff, "finished", 8) == 0;
+            }
+        }
+        if (m_skipFinished)
+        {
+            return;
+        }
+    }
+    m_ignored.insert(seqno);
+}
+
+void FrameParser::compact(int extra)
+{
+    if (m_start == 0)
+    {
+        //Nothing has been handed out, so we own the block and may grow it.
+        //If the header told us how big the frame is, grow once instead of
+        //doubling our way there.
+        int want = qMax(m_hint, m_buf.size() + extra);
+        if (want > m_buf.capacity())
+            m_buf.reserve(want == m_hint ? want : qMax(want, 2*m_buf.capacity()));
+        return;
+    }
+    //Frames that were handed out share the current block, so rather than
+    //writing into it (and detaching a copy of all of it) we start a new
+    //block holding only the frame that is still in progress. It is sized
+    //to what is there and known to be coming, no more: every frame parsed
+    //from it keeps all of it alive, and a message held on to for a while
+    //should not pin a block many times its size.
+    int tail = m_buf.size() - m_start;
+    QByteArray block;
+    block.reserve(qMax(tail + extra, m_hint));
+    block.append(m_buf.constData() + m_start, tail);
+    m_pos -= m_start;
+    m_cur.keyoff -= m_start;
+    m_cur.off -= m_start;
+    for (int i = 0; i < m_items.size(); i++)
+    {
+        m_items[i].keyoff -= m_start;
+        m_items[i].off -= m_start;
+    }
+    m_start = 0;
+    m_buf = block;
+}
+
+qint64 FrameParser::fill(QIODevice *d)
+{
+    qint64 avail = d->bytesAvailable();
+    if (avail <= 0)
+        return 0;
+    compact(int(avail));
+    int old = m_buf.size();
+    m_buf.resize(old + int(avail));
+    qint64 got = d->read(m_buf.data() + old, avail);
+    m_buf.resize(old + int(qMax<qint64>(got, 0)));
+    return got;
+}
+
+void FrameParser::append(const char *data, int length)
+{
+    compact(length);
+    m_buf.append(data, length);
+}
+
+FrameParser::Result FrameParser::next(AgentConnection *agent, PFrame &f)
+{
+    const char *buf = m_buf.constData();
+    const int size = m_buf.size();
+
+    forever
+    {
+        switch (m_state)
+        {
+        case ReadHeader:
+        {
+            if (size - m_pos < HeaderLength)
+                return NeedMore;
+            const char *h = buf + m_pos;
+            quint64 length, seqno;
+            if (h[4] != ' ' || h[15] != ' ' || h[26] != '\n' ||
+                !parseDecimal(h + 5, h + 15, &length) ||
+                !parseDecimal(h + 16, h + 26, &seqno))
+            {
+                return Malformed;
+            }
+            memcpy(m_type, h, 4);
+            m_seqno = (quint32) seqno;
+            m_skip = !m_ignored.isEmpty() && m_ignored.contains(m_seqno);
+            m_skipFinished = false;
+            //The length is advisory, we only use it to size the next block,
+            //which a skipped frame never needs
+            m_hint = m_skip ? 0 : (int) qMin<quint64>(HeaderLength + length, MaxObjectLength);
+            m_start = m_pos;
+            m_pos += HeaderLength;
+            m_items.resize(0);
+            m_state = ReadLine;
+            break;
+        }
+        case ReadLine:
+        {
+            const char *l = buf + m_pos;
+            const char *nl = static_cast<const char*>(memchr(l, '\n', size - m_pos));
+            if (nl == nullptr)
+            {
+                if (size - m_pos > MaxLineLength)
+                    return Malformed;
+                return NeedMore;
+            }
+            int linelen = nl - l;
+            m_pos += linelen + 1;
+            if (linelen == 3 && memcmp(l, "end", 3) == 0 && m_skip)
+            {
+                //Nobody is waiting for it, so it is never put together
+                if (m_skipFinished)
+                {
+                    m_ignored.remove(m_seqno);
+                }
+                m_skip = false;
+                m_state = ReadHeader;
+                m_start = m_pos;
+                m_hint = 0;
+                break;
+            }
+            if (linelen == 3 && memcmp(l, "end", 3) == 0)
+            {
+                //This frame is finished
+                f = build(agent);
+                m_state = ReadHeader;
+                m_start = m_pos;
+                m_hint = 0;
+                if (m_start == size)
+                {
+                    //No partial frame follows, let the block go with its frames
+                    m_buf = QByteArray();
+                    m_start = 0;
+                    m_pos = 0;
+                }
+                return FrameReady;
+            }
+            //Object lines are "kv <key> <len>", "po <dotform>:<ponum> <len>"
+            //and "ro <ronum> <len>"
+            if (linelen < 3 || l[2] != ' ')
+                return Malformed;
+            const char *tok = l + 3;
+            const char *sp = static_cast<const char*>(memchr(tok, ' ', nl - tok));
+            quint64 length, num;
+            if (sp == nullptr || !parseDecimal(sp + 1, nl, &length) || length >= MaxObjectLength)
+                return Malformed;
+            m_cur.length = (int) length;
+            m_cur.keyoff = 0;
+            m_cur.keylen = 0;
+            m_cur.num = 0;
+            if (l[0] == 'k' && l[1] == 'v')
+            {
+                m_cur.kind = KV;
+                m_cur.keyoff = tok - buf;
+                m_cur.keylen = sp - tok;
+            }
+            else if (l[0] == 'p' && l[1] == 'o')
+            {
+                const char *colon = static_cast<const char*>(memchr(tok, ':', sp - tok));
+                if (colon == nullptr || !parseDecimal(colon + 1, sp, &num) || num > 0xFFFFFFFFULL)
+                    return Malformed;
+                m_cur.kind = PO;
+                m_cur.num = (int)(quint32) num;
+            }
+            else if (l[0] == 'r' && l[1] == 'o')
+            {
+                if (!parseDecimal(tok, sp, &num) || num > 0xFFFFFFFFULL)
+                    return Malformed;
+                m_cur.kind = RO;
+                m_cur.num = (int)(quint32) num;
+            }
+            else
+            {
+                return Malformed;
+            }
+            if (m_skip)
+            {
+                //Only whether the frame finishes its transaction matters
+                m_skipFinishedKey = m_cur.kind == KV && m_cur.keylen == 8 && memcmp(tok, "finished", 8) == 0;
+                m_start = m_pos;
+            }
+            m_state = ReadBody;
+            break;
+        }
+        case ReadBody:
+            if (m_skip && !m_skipFinishedKey)
+            {
+                //Step over the body as it arrives rather than buffering it
+                int step = qMin(size - m_pos, m_cur.length);
+                m_pos += step;
+                m_cur.length -= step;
+                m_start = m_pos;
+                if (m_pos == size)
+                    return NeedMore;
+                if (buf[m_pos] != '\n')
+                    return Malformed;
+                m_pos++;
+                m_start = m_pos;
+                m_state = ReadLine;
+                break;
+            }
+            //The body is followed by a newline
+            if (size - m_pos < m_cur.length + 1)
+                return NeedMore;
+            if (buf[m_pos + m_cur.length] != '\n')
+                return Malformed;
+            if (m_skip)
+            {
+                m_skipFinished = m_cur.length == 4 && memcmp(buf + m_pos, "true", 4) == 0;
+                m_pos += m_cur.length + 1;
+                m_start = m_pos;
+                m_state = ReadLine;
+                break;
+            }
+            m_cur.off = m_pos;
+            m_items.append(m_cur);
+            m_pos += m_cur.length + 1;
+            m_state = ReadLine;
+            break;
+        }
+    }
+}
+
+PFrame FrameParser::build(AgentConnection *agent)
+{
+    //The objects live in an arena allocated along with the frame, and the
+    //data they point to is in the receive block, so the whole frame costs a
+    //handful of allocations however many objects it has
+    int nkv = 0, npo = 0, nro = 0;
+    for (int i = 0; i < m_items.size(); i++)
+    {
+        switch (m_items.at(i).kind)
+        {
+        case KV: nkv++; break;
+        case PO: npo++; break;
+        case RO: nro++; break;
+        }
+    }
+    //ROs come from the shared cache rather than the arena
+    int arena = nkv * Frame::arenaSizeOf<Header>() +
+                npo * Frame::arenaSizeOf<PayloadObject>();
+    PFrame f = agent->newFrame(m_type, m_seqno, arena);
+    f->reserveObjects(nkv, npo, nro);
+
+    const char *buf = m_buf.constData();
+    for (int i = 0; i < m_items.size(); i++)
+    {
+        const Item &it = m_items.at(i);
+        switch (it.kind)
+        {
+        case KV:
+            f->addHeader(f->make<Header>(buf + it.keyoff, it.keylen, buf + it.off, it.length, false));
+            break;
+        case PO:
+            f->addPayloadObject(f->make<PayloadObject>(it.num, PayloadBuffer(m_buf, buf + it.off, it.length)));
+            break;
+        case RO:
+            f->addSharedRoutingObject(RoutingObjectCache::global()->get(it.num, buf + it.off, it.length));
+            break;
+        }
+    }
+    f->retainBlock(m_buf);
+    m_items.resize(0);
+    return f;
+}
@@ -0,0 +1,92 @@
+#ifndef QTLIBBW_FRAMEPARSER_H
+#define QTLIBBW_FRAMEPARSER_H
+
+#include <QByteArray>
+#include <QSet>
+#include <QSharedPointer>
+#include <QVector>
+
+QT_FORWARD_DECLARE_CLASS(QIODevice)
+QT_FORWARD_DECLARE_CLASS(Frame)
+QT_FORWARD_DECLARE_CLASS(AgentConnection)
+
+/*
+ * Incremental decoder for the frames the agent sends us. Socket data is read
+ * into a single receive block and parsed in place, so a frame may arrive in
+ * any number of pieces. The headers and POs of a completed frame are views
+ * into the block, which the frame keeps alive for as long as it exists. ROs
+ * come from RoutingObjectCache, parsed once and shared between frames.
+ */
+class FrameParser
+{
+public:
+    enum Result
+    {
+        NeedMore,
+        FrameReady,
+        Malformed
+    };
+
+    FrameParser();
+
+    //Moves everything the device has buffered into the receive block
+    qint64 fill(QIODevice *d);
+    //Appends bytes that did not come from a device
+    void append(const char *data, int length);
+    //Parses as far as the buffered data allows. On FrameReady f holds the frame
+    Result next(AgentConnection *agent, QSharedPointer<Frame> &f);
+    //Discards all buffered data, for use when the stream restarts
+    void reset();
+    //Frames for seqno are stepped over from now on instead of being
+    //handed out, without keeping or decoding their contents. This lasts
+    //until the one that finishes the transaction has gone by
+    void ignore(quint32 seqno);
+
+private:
+    enum State
+    {
+        ReadHeader,
+        ReadLine,
+        ReadBody
+    };
+    enum ItemKind
+    {
+        KV,
+        PO,
+        RO
+    };
+    struct Item
+    {
+        ItemKind kind;
+        int num;
+        int keyoff;
+        int keylen;
+        int off;
+        int length;
+    };
+
+    void compact(int extra);
+    QSharedPointer<Frame> build(AgentConnection *agent);
+
+    QByteArray m_buf;
+    //Start of the frame being parsed, everything before it has been handed out
+    int m_start;
+    //Next byte to look at
+    int m_pos;
+    State m_state;
+    char m_type[5];
+    quint32 m_seqno;
+    //Expected size of the frame in progress, taken from its header
+    int m_hint;
+    Item m_cur;
+    QVector<Item> m_items;
+    QSet<quint32> m_ignored;
+    //The frame in progress is being stepped over
+    bool m_skip;
+    //Of a skipped frame, the item in progress is its finished kv
+    bool m_skipFinishedKey;
+    //The skipped frame finishes its transaction
+    bool m_skipFinished;
+};
+
+#endif // QTLIBBW_FRAMEPARSER_H
@@ -18,6 +18,11 @@ QString Message::getHeaderS(QString key)
     return frame->getHeaderS(key);
 }
 
+QString Message::getHeaderS(Header::Key key)
+{
+    return frame->getHeaderS(key);
+}
+
 QList<PayloadObject*> Message::POs()
 {
     return frame->pos;
@@ -52,16 +57,57 @@ QList<PayloadObject*> Message::FilterPOs(int ponum, int mask)
 }
 
 
+PayloadBuffer PayloadBuffer::adopt(const char *data, int length, std::function<void(const char*)> deleter)
+{
+    PayloadBuffer rv;
+    rv.m_external = QSharedPointer<const char>(data, deleter);
+    rv.m_data = data;
+    rv.m_length = length;
+    return rv;
+}
+
+PayloadBuffer PayloadBuffer::borrow(const char *data, int length)
+{
+    PayloadBuffer rv;
+    rv.m_data = data;
+    rv.m_length = length;
+    return rv;
+}
+
+QByteArray PayloadBuffer::toByteArray() const
+{
+    if (isWholeArray())
+        return m_block;
+    return QByteArray(m_data, m_length);
+}
+
+
 PayloadObject::~PayloadObject()
 {
-    delete [] m_data;
 }
 
 
 // This will eventually construct subclasses too
-PayloadObject* PayloadObject::load(int ponum, const char* dat, int size)
+PayloadObject* PayloadObject::load(int ponum, const char* dat, int size, bool owned)
+{
+    if (owned)
+    {
+        return new PayloadObject(ponum, PayloadBuffer::adopt(dat, size, [](const char *p)
+        {
+            delete [] p;
+        }));
+    }
+    return new PayloadObject(ponum, PayloadBuffer::borrow(dat, size));
+}
+
+PayloadObject* PayloadObject::load(int ponum, const PayloadBuffer &buffer)
+{
+    return new PayloadObject(ponum, buffer);
+}
+
+PayloadObject* PayloadObject::clone(int ponum) const
 {
-    return new PayloadObject(ponum, dat, size);
+    return new PayloadObject(ponum, m_buffer);
 }
 
 
@@ -71,26 +117,26 @@ int PayloadObject::ponum()
 }
 const char* PayloadObject::content()
 {
-    return m_data;
+    return m_buffer.data();
 }
 int PayloadObject::length()
 {
-    return m_length;
+    return m_buffer.length();
 }
 
 QByteArray PayloadObject::contentArray()
 {
-    return QByteArray::fromRawData(m_data, m_length);
+    if (m_buffer.isWholeArray())
+        return m_buffer.toByteArray();
+    return QByteArray::fromRawData(m_buffer.data(), m_buffer.length());
 }
 
-PayloadObject* createBasePayloadObject(int ponum, QByteArray &contents)
+PayloadObject* createBasePayloadObject(int ponum, const QByteArray &contents)
 {
-    return createBasePayloadObject(ponum, contents.data(), contents.length());
+    return PayloadObject::load(ponum, PayloadBuffer(contents));
 }
 
 PayloadObject* createBasePayloadObject(int ponum, const char* dat, int length)
 {
-    char* datcopy = new char [length];
-    memcpy(datcopy,dat,length);
-    return PayloadObject::load(ponum, datcopy, length);
+    return PayloadObject::load(ponum, PayloadBuffer(QByteArray(dat, length)));
 }
@@ -2,6 +2,8 @@
 #define QTLIBBW_MESSAGE_H
 
 #include <QSharedPointer>
+#include <QByteArray>
+#include <functional>
 #include "agentconnection.h"
 
 QT_FORWARD_DECLARE_CLASS(Message)
@@ -15,6 +17,7 @@ public:
     Message();
     static PMessage fromFrame(PFrame f);
     QString getHeaderS(QString key);
+    QString getHeaderS(Header::Key key);
     QList<PayloadObject*> POs();
     QList<PayloadObject*> FilterPOs(int ponum);
     QList<PayloadObject*> FilterPOs(int ponum, int mask);
@@ -23,23 +26,78 @@ private:
     PFrame frame;
 };
 
+/*
+ * The bytes behind a payload object. A buffer either shares a QByteArray
+ * (possibly only a slice of it, as for POs in a received frame), or holds
+ * external memory that is released through a deleter once the last copy
+ * goes away. Copies are cheap and may be handed to other threads.
+ */
+class PayloadBuffer
+{
+public:
+    PayloadBuffer() : m_data(nullptr), m_length(0) {}
+    //Shares bytes, nothing is copied
+    explicit PayloadBuffer(const QByteArray &bytes)
+        : m_block(bytes), m_data(bytes.constData()), m_length(bytes.size()) {}
+    //A slice of block, which is kept alive as long as the buffer is
+    PayloadBuffer(const QByteArray &block, const char *data, int length)
+        : m_block(block), m_data(data), m_length(length) {}
+    //Takes over external memory, deleter is called with data when the last
+    //copy of the buffer is destroyed, on whichever thread that happens
+    static PayloadBuffer adopt(const char *data, int length, std::function<void(const char*)> deleter);
+    //Refers to memory owned by someone else, who must keep it alive
+    static PayloadBuffer borrow(const char *data, int length);
+
+    const char* data() const { return m_data; }
+    int length() const { return m_length; }
+    //The bytes as a QByteArray. This does not copy if the buffer covers a
+    //whole QByteArray, otherwise it copies rather than risk a dangling array
+    QByteArray toByteArray() const;
+    //True if the buffer is exactly a QByteArray, which toByteArray returns
+    bool isWholeArray() const
+    {
+        return m_data == m_block.constData() && m_length == m_block.size() && !m_block.isNull();
+    }
+private:
+    QByteArray m_block;
+    QSharedPointer<const char> m_external;
+    const char *m_data;
+    int m_length;
+};
+
 class PayloadObject
 {
 public:
     ~PayloadObject();
-    static PayloadObject* load(int ponum, const char* dat, int length);
+    //If owned is true the object takes dat, which must come from new[].
+    //If it is false, dat belongs to someone else who must outlive the object
+    static PayloadObject* load(int ponum, const char* dat, int length, bool owned = true);
+    static PayloadObject* load(int ponum, const PayloadBuffer &buffer);
+    //Another object with the same contents, which are shared rather than
+    //copied, for attaching one payload to several frames
+    PayloadObject* clone(int ponum) const;
+    PayloadObject* clone() const { return clone(m_ponum); }
     int ponum();
     const char* content();
+    //Does not copy. The array stays valid after the object is gone if the
+    //object was made from a QByteArray, otherwise only as long as the object
     QByteArray contentArray();
+    //The shared buffer, which can outlive the object and cross threads
+    PayloadBuffer buffer() const { return m_buffer; }
     int length();
 protected:
-    PayloadObject(int ponum, const char *data, int length) : m_ponum(ponum), m_data(data), m_length(length) {}
+    PayloadObject(int ponum, const PayloadBuffer &buffer)
+        : m_ponum(ponum), m_buffer(buffer) {}
     int m_ponum;
-    const char *m_data;
-    int m_length;
+    PayloadBuffer m_buffer;
+
+    //Frames construct received POs in their arena
+    friend class Frame;
 };
 
-PayloadObject* createBasePayloadObject(int ponum, QByteArray &contents);
+//Shares contents, so later changes to the array do not affect the object
+PayloadObject* createBasePayloadObject(int ponum, const QByteArray &contents);
+//Copies dat
 PayloadObject* createBasePayloadObject(int ponum, const char* dat, int length);
 
 #endif // QTLIBBW_MESSAGE_H
@@ -0,0 +1,366 @@
+#include "metadatacache.h"
+
+#include <QSharedPointer>
+#include <QVector>
+
+#include <msgpack.h>
+
+namespace
+{
+    //Past this many nodes, ones that are stale or empty get freed
+    const int MaxNodes = 4096;
+
+    //One resolve, waiting on the prefixes of its URI
+    struct Gather
+    {
+        int remaining;
+        QString error;
+        QVector<MetadataCache::Entries> entries;
+        QVector<QString> prefixes;
+    };
+}
+
+MetadataCache::MetadataCache(BW *bw, qint64 ttlMsecs)
+    : m_bw(bw), m_ttl(ttlMsecs), m_live(false), m_nodes(0)
+{
+    m_clock.start();
+}
+
+MetadataCache::~MetadataCache()
+{
+    foreach (Node *c, m_root.children)
+    {
+        destroy(c);
+    }
+}
+
+void MetadataCache::resolve(const QString &uri, std::function<void(QString, Entries, QMap<QString, QString>)> on_done)
+{
+    QStringList parts = uri.split('/', QString::SkipEmptyParts);
+    if (parts.isEmpty())
+    {
+        on_done("", Entries(), QMap<QString, QString>());
+        return;
+    }
+    if (m_nodes > MaxNodes)
+    {
+        prune(&m_root);
+    }
+
+    QList<Node*> path;
+    walk(parts, true, &path);
+
+    auto g = QSharedPointer<Gather>::create();
+    g->remaining = path.size();
+    g->entries.resize(path.size());
+    g->prefixes.resize(path.size());
+    for (int i = 0; i < path.size(); i++)
+    {
+        Node *n = path[i];
+        g->prefixes[i] = n->prefix;
+        //Waiters may run right away, or long after nodes have been pruned,
+        //so each takes its own copy of the entries
+        ensure(n, [g, i, n, on_done](QString error)
+        {
+            if (error.length() != 0)
+            {
+                if (g->error.length() == 0)
+                {
+                    g->error = error;
+                }
+            }
+            else
+            {
+                g->entries[i] = n->entries;
+            }
+            if (--g->remaining != 0)
+            {
+                return;
+            }
+            if (g->error.length() != 0)
+            {
+                on_done(g->error, Entries(), QMap<QString, QString>());
+                return;
+            }
+            Entries rvM;
+            QMap<QString, QString> rvO;
+            for (int j = 0; j < g->entries.size(); j++)
+            {
+                const Entries &e = g->entries.at(j);
+                for (auto k = e.cbegin(); k != e.cend(); k++)
+                {
+                    rvM[k.key()] = k.value();
+                    rvO[k.key()] = g->prefixes.at(j);
+                }
+            }
+            on_done("", rvM, rvO);
+        });
+    }
+}
+
+void MetadataCache::invalidate(const QString &uri)
+{
+    QList<Node*> path;
+    Node *n = walk(uri.split('/', QString::SkipEmptyParts), false, &path);
+    if (n != nullptr && n != &m_root && n->state == Node::Ready)
+    {
+        n->state = Node::Empty;
+        n->entries.clear();
+    }
+}
+
+void MetadataCache::clear()
+{
+    QList<Node*> todo;
+    todo.append(&m_root);
+    while (!todo.isEmpty())
+    {
+        Node *n = todo.takeLast();
+        dropLive(n);
+        if (n->state == Node::Ready)
+        {
+            n->state = Node::Empty;
+            n->entries.clear();
+        }
+        todo.append(n->children.values());
+    }
+}
+
+void MetadataCache::setTtl(qint64 msecs)
+{
+    m_ttl = msecs;
+}
+
+void MetadataCache::setLive(bool live)
+{
+    if (live == m_live)
+    {
+        return;
+    }
+    m_live = live;
+    //Nodes fetched from now on subscribe as they are fetched. Going back,
+    //every subscription goes and TTLs apply again
+    if (!live)
+    {
+        QList<Node*> todo = m_root.children.values();
+        while (!todo.isEmpty())
+        {
+            Node *n = todo.takeLast();
+            dropLive(n);
+            todo.append(n->children.values());
+        }
+    }
+}
+
+MetadataCache::Node* MetadataCache::walk(const QStringList &parts, bool create, QList<Node*> *path)
+{
+    Node *n = &m_root;
+    foreach (const QString &part, parts)
+    {
+        Node *c = n->children.value(part, nullptr);
+        if (c == nullptr)
+        {
+            if (!create)
+            {
+                return nullptr;
+            }
+            c = new Node;
+            c->segment = part;
+            c->prefix = n->prefix + part + "/";
+            c->parent = n;
+            n->children.insert(part, c);
+            m_nodes++;
+        }
+        path->append(c);
+        n = c;
+    }
+    return n;
+}
+
+bool MetadataCache::fresh(Node *n)
+{
+    if (n->state != Node::Ready)
+    {
+        return false;
+    }
+    if (m_live && n->liveHandle.length() != 0)
+    {
+        return true;
+    }
+    return m_clock.elapsed() - n->fetchedAt < m_ttl;
+}
+
+void MetadataCache::ensure(Node *n, std::function<void(QString)> waiter)
+{
+    if (fresh(n))
+    {
+        waiter("");
+        return;
+    }
+    n->waiters.append(waiter);
+    if (n->state == Node::Pending)
+    {
+        return;
+    }
+    n->state = Node::Pending;
+    //Subscribing first means nothing published after the query is missed
+    if (m_live)
+    {
+        subscribeLive(n);
+    }
+    //Each message is read as it arrives instead of all of them being held
+    //until the last one, so a prefix with many keys costs only its entries
+    struct Fetch
+    {
+        Entries entries;
+        bool done;
+    };
+    QSharedPointer<Fetch> fetch(new Fetch());
+    fetch->done = false;
+    m_bw->query(n->prefix + "!meta/", "", true, QList<RoutingObject*>(), QDateTime(), -1, "",
+                false, false, [this, n, fetch](QString error, PMessage m, bool final)
+    {
+        if (fetch->done)
+        {
+            return;
+        }
+        if (error.length() == 0 && m != nullptr)
+        {
+            QString key;
+            MetadataTuple value;
+            bool present;
+            readEntry(m, &key, &value, &present);
+            if (present)
+            {
+                fetch->entries.insert(key, value);
+            }
+        }
+        if (error.length() != 0 || final)
+        {
+            fetch->done = true;
+            onFetched(n, error, fetch->entries);
+        }
+    });
+}
+
+void MetadataCache::onFetched(Node *n, QString error, const Entries &entries)
+{
+    QList<std::function<void(QString)>> waiters;
+    waiters.swap(n->waiters);
+    if (error.length() != 0)
+    {
+        n->state = Node::Empty;
+    }
+    else
+    {
+        n->entries = entries;
+        n->state = Node::Ready;
+        n->fetchedAt = m_clock.elapsed();
+    }
+    foreach (auto w, waiters)
+    {
+        w(error);
+    }
+}
+
+void MetadataCache::subscribeLive(Node *n)
+{
+    if (n->liveHandle.length() != 0)
+    {
+        return;
+    }
+    //Until the agent answers the handle is a placeholder, which also keeps
+    //the node from being pruned under the callbacks
+    n->liveHandle = QStringLiteral("pending");
+    m_bw->subscribe(n->prefix + "!meta/+", "", true, QList<RoutingObject*>(), QDateTime(), -1, "",
+                    false, false, [this, n](PMessage m)
+    {
+        onLiveMessage(n, m);
+    }, [this, n](QString error, QString handle)
+    {
+        if (error.length() != 0)
+        {
+            n->liveHandle = QString();
+        }
+        else if (!m_live)
+        {
+            //Live mode was turned off while we waited
+            n->liveHandle = QString();
+            m_bw->unsubscribe(handle);
+        }
+        else
+        {
+            n->liveHandle = handle;
+        }
+    });
+}
+
+void MetadataCache::onLiveMessage(Node *n, PMessage m)
+{
+    if (n->state != Node::Ready)
+    {
+        return;
+    }
+    QString key;
+    MetadataTuple value;
+    bool present;
+    readEntry(m, &key, &value, &present);
+    //delMetadata publishes an empty message
+    if (present)
+    {
+        n->entries.insert(key, value);
+    }
+    else
+    {
+        n->entries.remove(key);
+    }
+}
+
+void MetadataCache::dropLive(Node *n)
+{
+    if (n->liveHandle.length() == 0 || n->liveHandle == QStringLiteral("pending"))
+    {
+        return;
+    }
+    m_bw->unsubscribe(n->liveHandle);
+    n->liveHandle = QString();
+    //Without the subscription the entries age like any others, from now
+    n->fetchedAt = m_clock.elapsed();
+}
+
+void MetadataCache::prune(Node *n)
+{
+    foreach (Node *c, n->children.values())
+    {
+        prune(c);
+        bool busy = c->state == Node::Pending || !c->waiters.isEmpty() ||
+                    c->liveHandle == QStringLiteral("pending");
+        if (!busy && c->children.isEmpty() && !fresh(c))
+        {
+            n->children.remove(c->segment);
+            destroy(c);
+        }
+    }
+}
+
+void MetadataCache::destroy(Node *n)
+{
+    foreach (Node *c, n->children)
+    {
+        destroy(c);
+    }
+    dropLive(n);
+    m_nodes--;
+    delete n;
+}
+
+void MetadataCache::readEntry(PMessage m, QString *key, MetadataTuple *value, bool *present)
+{
+    *key = m->getHeaderS(Header::KeyURI).section('/', -1);
+    *present = false;
+    foreach (PayloadObject *po, m->FilterPOs(bwpo::num::SMetadata, bwpo::mask::SMetadata))
+    {
+        *value = MetadataTuple(MsgPack::unpack(po->contentArray()).toMap());
+        *present = true;
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef QTLIBBW_METADATACACHE_H
+#define QTLIBBW_METADATACACHE_H
+
+#include "bosswave.h"
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QString>
+#include <QStringList>
+#include <functional>
+
+/*
+ * Metadata published under each URI prefix, held as a tree with one node
+ * per path segment. Resolving a URI needs the metadata at every prefix of
+ * it, and sibling URIs share most of those prefixes, so each node is
+ * fetched once and reused until its TTL runs out. A node being fetched
+ * collects everyone else who wants it rather than fetching again. In live
+ * mode each fetched node subscribes to its !meta/ keys and is kept current
+ * instead of expiring. Lives on, and is only used from, the BW thread.
+ */
+class MetadataCache
+{
+public:
+    typedef QMap<QString, MetadataTuple> Entries;
+
+    MetadataCache(BW *bw, qint64 ttlMsecs);
+    ~MetadataCache();
+
+    //The merged metadata for uri, as BW::getMetadata gives it. A key set at
+    //several prefixes takes the value from the deepest
+    void resolve(const QString &uri, std::function<void(QString, Entries, QMap<QString, QString>)> on_done);
+    //Forgets what is cached for the prefix that uri names
+    void invalidate(const QString &uri);
+    void clear();
+
+    //0 fetches afresh every time, which still shares concurrent fetches
+    void setTtl(qint64 msecs);
+    void setLive(bool live);
+
+private:
+    struct Node
+    {
+        enum State
+        {
+            Empty,
+            Pending,
+            Ready
+        };
+        Node() : parent(nullptr), state(Empty), fetchedAt(0) {}
+        QString segment;
+        //"a/b/" for the node under a under the root
+        QString prefix;
+        Node *parent;
+        QHash<QString, Node*> children;
+        State state;
+        qint64 fetchedAt;
+        Entries entries;
+        QList<std::function<void(QString)>> waiters;
+        //Agent subscription keeping entries current in live mode
+        QString liveHandle;
+    };
+
+    Node* walk(const QStringList &parts, bool create, QList<Node*> *path);
+    bool fresh(Node *n);
+    void ensure(Node *n, std::function<void(QString)> waiter);
+    void onFetched(Node *n, QString error, const Entries &entries);
+    void subscribeLive(Node *n);
+    void onLiveMessage(Node *n, PMessage m);
+    void dropLive(Node *n);
+    void prune(Node *n);
+    void destroy(Node *n);
+    static void readEntry(PMessage m, QString *key, MetadataTuple *value, bool *present);
+
+    BW *m_bw;
+    Node m_root;
+    QElapsedTimer m_clock;
+    qint64 m_ttl;
+    bool m_live;
+    int m_nodes;
+};
+
+#endif // QTLIBBW_METADATACACHE_H
@@ -0,0 +1,174 @@
+#include "msgpackschema.h"
+
+#include <msgpackutf8.h>
+
+namespace bwschema
+{
+
+Status Reader::expect(MsgPackCursor::Type t, MsgPackCursor::Type alt)
+{
+    MsgPackCursor::Type have = m_cur.type();
+    if (have == MsgPackCursor::Invalid)
+        return Malformed;
+    if (have != t && have != alt)
+        return Mistyped;
+    return Ok;
+}
+
+Status Reader::advance(const MsgPackCursor &next)
+{
+    //Running into the end of the data is fine, anything else is not
+    if (!next.isValid() && !next.atEnd())
+        return Malformed;
+    m_cur = next;
+    return Ok;
+}
+
+Status Reader::readNil()
+{
+    Status s = expect(MsgPackCursor::Nil);
+    if (s != Ok)
+        return s;
+    return advance(m_cur.next());
+}
+
+Status Reader::readBool(bool *out)
+{
+    Status s = expect(MsgPackCursor::Bool);
+    if (s != Ok)
+        return s;
+    *out = m_cur.toBool();
+    return advance(m_cur.next());
+}
+
+Status Reader::readInteger(quint64 *bits, bool *negative)
+{
+    Status s = expect(MsgPackCursor::Integer);
+    if (s != Ok)
+        return s;
+    bool ok;
+    *bits = m_cur.toULongLong(&ok);
+    *negative = false;
+    if (!ok)
+    {
+        //Not representable unsigned, so either negative or truncated
+        *bits = (quint64) m_cur.toLongLong(&ok);
+        *negative = true;
+        if (!ok)
+            return Malformed;
+    }
+    return advance(m_cur.next());
+}
+
+Status Reader::readDouble(double *out)
+{
+    //Integers are fine where a float is wanted
+    Status s = expect(MsgPackCursor::Float, MsgPackCursor::Integer);
+    if (s != Ok)
+        return s;
+    bool ok;
+    *out = m_cur.toDouble(&ok);
+    if (!ok)
+        return Malformed;
+    return advance(m_cur.next());
+}
+
+Status Reader::readString(const char **data, int *length)
+{
+    Status s = expect(MsgPackCursor::String);
+    if (s != Ok)
+        return s;
+    *data = m_cur.bytes(length);
+    if (*data == nullptr)
+        return Malformed;
+    return advance(m_cur.next());
+}
+
+Status Reader::readBinary(const char **data, int *length)
+{
+    Status s = expect(MsgPackCursor::Binary, MsgPackCursor::String);
+    if (s != Ok)
+        return s;
+    *data = m_cur.bytes(length);
+    if (*data == nullptr)
+        return Malformed;
+    return advance(m_cur.next());
+}
+
+Status Reader::readArrayHeader(quint32 *count)
+{
+    Status s = expect(MsgPackCursor::Array);
+    if (s != Ok)
+        return s;
+    *count = m_cur.count();
+    //Step into the array rather than over it
+    return advance(*count > 0 ? m_cur.first() : m_cur.next());
+}
+
+Status Reader::readMapHeader(quint32 *count)
+{
+    Status s = expect(MsgPackCursor::Map);
+    if (s != Ok)
+        return s;
+    *count = m_cur.count();
+    return advance(*count > 0 ? m_cur.first() : m_cur.next());
+}
+
+Status Reader::skip()
+{
+    if (!m_cur.isValid())
+        return Malformed;
+    return advance(m_cur.next());
+}
+
+Status readValue(Reader &r, bool &out)
+{
+    return r.readBool(&out);
+}
+
+Status readValue(Reader &r, float &out)
+{
+    double d;
+    Status s = r.readDouble(&d);
+    if (s == Ok)
+        out = float(d);
+    return s;
+}
+
+Status readValue(Reader &r, double &out)
+{
+    return r.readDouble(&out);
+}
+
+Status readValue(Reader &r, QString &out)
+{
+    const char *p;
+    int len;
+    Status s = r.readString(&p, &len);
+    if (s == Ok)
+        out = MsgPack::fromUtf8(p, len);
+    return s;
+}
+
+Status readValue(Reader &r, QByteArray &out)
+{
+    const char *p;
+    int len;
+    Status s = r.readBinary(&p, &len);
+    if (s == Ok)
+        out = QByteArray(p, len);
+    return s;
+}
+
+Status readValue(Reader &r, QVariant &out)
+{
+    //The escape hatch for fields of no fixed type
+    MsgPackCursor c(r.pos(), r.remaining());
+    Status s = r.skip();
+    if (s != Ok)
+        return s;
+    out = c.toVariant();
+    return Ok;
+}
+
+}
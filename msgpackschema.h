@@ -0,0 +1,322 @@
+#ifndef QTLIBBW_MSGPACKSCHEMA_H
+#define QTLIBBW_MSGPACKSCHEMA_H
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+#include <QVariant>
+#include <QVector>
+
+#include <msgpackcursor.h>
+
+#include <limits>
+#include <utility>
+#include <string.h>
+
+/*
+ * Decodes msgpack maps straight into C++ structs. A struct declares its
+ * fields once, at global scope:
+ *
+ *     struct Reading
+ *     {
+ *         qint64 time;
+ *         double value;
+ *         QString unit;
+ *     };
+ *     BW_MSGPACK_SCHEMA(Reading,
+ *         BW_SCHEMA_FIELD(time),
+ *         BW_SCHEMA_FIELD(value),
+ *         BW_SCHEMA_FIELD(unit))
+ *
+ * and bwschema::decode(bytes, reading) then fills it in by walking the
+ * encoded map once, matching keys against the field names by their bytes.
+ * No QVariant tree is built and no QString is made for a key. Fields may be
+ * bools, integers, floats, QString, QByteArray, QVariant (decoded the usual
+ * way), other structs with a schema, and QVector or QList of any of these.
+ */
+
+namespace bwschema
+{
+    //Specialized by BW_MSGPACK_SCHEMA
+    template <typename T> struct Schema;
+
+    enum Status
+    {
+        Ok,
+        //The value is well formed but cannot go into the field
+        Mistyped,
+        //The encoding is broken or truncated
+        Malformed
+    };
+
+    /**
+     * @brief What bwschema::decode found. Bit i of the masks stands for the
+     * i-th field in the schema, so a schema can have at most 64 fields
+     *
+     * @ingroup cpp
+     * @since 1.5
+     */
+    struct DecodeResult
+    {
+        DecodeResult() : malformed(false), missing(0), mistyped(0) {}
+        /// True if every field was present with the right type
+        bool ok() const { return !malformed && missing == 0 && mistyped == 0; }
+        /// The payload is not a well formed msgpack map
+        bool malformed;
+        /// Fields that were not in the map
+        quint64 missing;
+        /// Fields whose value had the wrong type or did not fit. These keep
+        /// whatever they held before
+        quint64 mistyped;
+    };
+
+    //Reads msgpack values one after another from memory it does not own,
+    //telling values of the wrong type apart from broken encoding
+    class Reader
+    {
+    public:
+        Reader(const char *data, int length)
+            : m_cur(data, length), m_end(data + length) {}
+
+        const char* pos() const { return m_cur.data(); }
+        void seek(const char *p) { m_cur = MsgPackCursor(p, int(m_end - p)); }
+        bool atEnd() const { return m_cur.atEnd(); }
+        int remaining() const { return int(m_end - m_cur.data()); }
+
+        Status readNil();
+        Status readBool(bool *out);
+        //value is negative exactly when negative is set
+        Status readInteger(quint64 *bits, bool *negative);
+        Status readDouble(double *out);
+        //str only, data points into the payload
+        Status readString(const char **data, int *length);
+        //bin, and str as well
+        Status readBinary(const char **data, int *length);
+        Status readArrayHeader(quint32 *count);
+        Status readMapHeader(quint32 *count);
+        //Steps over one value of any type, however deeply nested
+        Status skip();
+
+    private:
+        Status expect(MsgPackCursor::Type t, MsgPackCursor::Type alt = MsgPackCursor::Invalid);
+        Status advance(const MsgPackCursor &next);
+
+        MsgPackCursor m_cur;
+        const char *m_end;
+    };
+
+    Status readValue(Reader &r, bool &out);
+    Status readValue(Reader &r, float &out);
+    Status readValue(Reader &r, double &out);
+    Status readValue(Reader &r, QString &out);
+    Status readValue(Reader &r, QByteArray &out);
+    Status readValue(Reader &r, QVariant &out);
+
+    template <typename I> Status readIntegral(Reader &r, I &out)
+    {
+        quint64 bits;
+        bool negative;
+        Status s = r.readInteger(&bits, &negative);
+        if (s != Ok)
+            return s;
+        if (negative)
+        {
+            qint64 v = (qint64) bits;
+            if (!std::numeric_limits<I>::is_signed || v < (qint64) std::numeric_limits<I>::min())
+                return Mistyped;
+            out = (I) v;
+        }
+        else
+        {
+            if (bits > (quint64) std::numeric_limits<I>::max())
+                return Mistyped;
+            out = (I) bits;
+        }
+        return Ok;
+    }
+    inline Status readValue(Reader &r, qint8 &out) { return readIntegral(r, out); }
+    inline Status readValue(Reader &r, quint8 &out) { return readIntegral(r, out); }
+    inline Status readValue(Reader &r, qint16 &out) { return readIntegral(r, out); }
+    inline Status readValue(Reader &r, quint16 &out) { return readIntegral(r, out); }
+    inline Status readValue(Reader &r, qint32 &out) { return readIntegral(r, out); }
+    inline Status readValue(Reader &r, quint32 &out) { return readIntegral(r, out); }
+    inline Status readValue(Reader &r, qint64 &out) { return readIntegral(r, out); }
+    inline Status readValue(Reader &r, quint64 &out) { return readIntegral(r, out); }
+
+    template <typename T> Status readStruct(Reader &r, T &out, DecodeResult *res);
+
+    //Anything else must have a schema. It is read into a copy, so a field
+    //that turns out mistyped is left as it was
+    template <typename T> Status readValue(Reader &r, T &out)
+    {
+        DecodeResult res;
+        T v(out);
+        Status s = readStruct(r, v, &res);
+        if (s != Ok)
+            return s;
+        //A nested struct that is incomplete counts against its field
+        if (!res.ok())
+            return Mistyped;
+        std::swap(out, v);
+        return Ok;
+    }
+
+    template <typename C> Status readSequence(Reader &r, C &out)
+    {
+        quint32 n;
+        Status s = r.readArrayHeader(&n);
+        if (s != Ok)
+            return s;
+        //Only replaces out once every element has been read
+        C seq;
+        //Every element takes at least a byte, so a bogus count cannot make
+        //us reserve much more than the payload
+        seq.reserve((int) qMin<quint32>(n, r.remaining()));
+        for (quint32 i = 0; i < n; i++)
+        {
+            typename C::value_type v = typename C::value_type();
+            s = readValue(r, v);
+            if (s != Ok)
+                return s;
+            seq.append(v);
+        }
+        out.swap(seq);
+        return Ok;
+    }
+    template <typename T> Status readValue(Reader &r, QVector<T> &out) { return readSequence(r, out); }
+    template <typename T> Status readValue(Reader &r, QList<T> &out) { return readSequence(r, out); }
+
+    //Reads a value into a field, stepping over it if it does not fit
+    template <typename F> Status readField(Reader &r, F &field)
+    {
+        const char *mark = r.pos();
+        Status s = readValue(r, field);
+        if (s == Mistyped)
+        {
+            r.seek(mark);
+            if (r.skip() != Ok)
+                return Malformed;
+        }
+        return s;
+    }
+
+    //Visitors handed to Schema<T>::visit
+    struct FieldCounter
+    {
+        FieldCounter() : count(0) {}
+        template <typename F> void field(const char *, int, F &) { count++; }
+        int count;
+    };
+
+    struct FieldDecoder
+    {
+        FieldDecoder(Reader &r, const char *key, int keylen)
+            : r(r), key(key), keylen(keylen), index(0), matched(-1), status(Ok) {}
+        template <typename F> void field(const char *name, int namelen, F &f)
+        {
+            if (matched < 0 && namelen == keylen && memcmp(name, key, keylen) == 0)
+            {
+                matched = index;
+                status = readField(r, f);
+            }
+            index++;
+        }
+        Reader &r;
+        const char *key;
+        int keylen;
+        int index;
+        int matched;
+        Status status;
+    };
+
+    template <typename T> Status readStruct(Reader &r, T &out, DecodeResult *res)
+    {
+        FieldCounter counter;
+        Schema<T>::visit(out, counter);
+        Q_ASSERT(counter.count <= 64);
+        quint64 seen = 0;
+
+        quint32 n;
+        Status s = r.readMapHeader(&n);
+        if (s != Ok)
+            return s;
+        for (quint32 i = 0; i < n; i++)
+        {
+            const char *key;
+            int keylen;
+            const char *mark = r.pos();
+            s = r.readString(&key, &keylen);
+            if (s == Malformed)
+                return s;
+            if (s == Mistyped)
+            {
+                //Not a string key, so none of ours
+                r.seek(mark);
+                if (r.skip() != Ok || r.skip() != Ok)
+                    return Malformed;
+                continue;
+            }
+            FieldDecoder d(r, key, keylen);
+            Schema<T>::visit(out, d);
+            if (d.matched < 0)
+            {
+                if (r.skip() != Ok)
+                    return Malformed;
+                continue;
+            }
+            if (d.status == Malformed)
+                return Malformed;
+            quint64 bit = Q_UINT64_C(1) << d.matched;
+            seen |= bit;
+            if (d.status == Mistyped)
+                res->mistyped |= bit;
+            else
+                res->mistyped &= ~bit;
+        }
+        quint64 all = counter.count == 64 ? ~Q_UINT64_C(0) : (Q_UINT64_C(1) << counter.count) - 1;
+        res->missing = all & ~seen;
+        return Ok;
+    }
+
+    /**
+     * @brief Decode a msgpack map into a struct that has a schema
+     * @param data The encoded map
+     * @param length The length of data
+     * @param out The struct to fill in. Fields that are missing or mistyped are left as they were
+     * @return Which fields could not be filled in
+     *
+     * @ingroup cpp
+     * @since 1.5
+     */
+    template <typename T> DecodeResult decode(const char *data, int length, T &out)
+    {
+        DecodeResult res;
+        Reader r(data, length);
+        if (readStruct(r, out, &res) != Ok)
+        {
+            res.malformed = true;
+            res.mistyped = 0;
+        }
+        return res;
+    }
+    template <typename T> DecodeResult decode(const QByteArray &data, T &out)
+    {
+        return decode(data.constData(), data.size(), out);
+    }
+}
+
+#define BW_SCHEMA_FIELD(name) v.field(#name, int(sizeof(#name)) - 1, obj.name)
+
+#define BW_MSGPACK_SCHEMA(Type, ...)                        \
+    namespace bwschema                                      \
+    {                                                       \
+        template <> struct Schema<Type>                     \
+        {                                                   \
+            template <typename V> static void visit(Type &obj, V &v) \
+            {                                               \
+                __VA_ARGS__;                                \
+            }                                               \
+        };                                                  \
+    }
+
+#endif // QTLIBBW_MSGPACKSCHEMA_H
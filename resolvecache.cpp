@@ -0,0 +1,202 @@
+#include "resolvecache.h"
+
+#include <QMutexLocker>
+
+namespace
+{
+    //Aliases live on the blockchain and hardly ever change. Registry
+    //answers carry a validity that revocation can change
+    const qint64 AliasTtl = 10 * 60 * 1000;
+    const qint64 RegistryTtl = 60 * 1000;
+    //Chains are made of DOTs that expire, and a request refused on a
+    //cached chain drops it anyway
+    const qint64 AccessChainTtl = 5 * 60 * 1000;
+    const qint64 NegativeTtl = 15 * 1000;
+}
+
+ResolveCache::ResolveCache(int maxEntries)
+    : m_maxEntries(maxEntries), m_answered(0), m_generation(0)
+{
+    m_head.prev = &m_head;
+    m_head.next = &m_head;
+    for (int i = 0; i < Kinds; i++)
+    {
+        m_ttl[i] = AliasTtl;
+        m_negativeTtl[i] = NegativeTtl;
+    }
+    m_ttl[BW::ResolveRegistry] = RegistryTtl;
+    m_ttl[BW::ResolveAccessChain] = AccessChainTtl;
+    m_clock.start();
+}
+
+ResolveCache::~ResolveCache()
+{
+    foreach (Node *n, m_index)
+    {
+        delete n;
+    }
+}
+
+void ResolveCache::lookup(BW::ResolveKind kind, const QByteArray &key, Fetch fetch, Done on_done)
+{
+    Q_ASSERT(kind >= 0 && int(kind) < Kinds);
+    Key k(kind, key);
+    quint64 generation;
+    {
+        QMutexLocker l(&m_lock);
+        Node *n = m_index.value(k, nullptr);
+        if (n != nullptr && n->pending)
+        {
+            m_stats.coalesced++;
+            n->waiters.append(on_done);
+            return;
+        }
+        if (n != nullptr && m_clock.elapsed() < n->expires)
+        {
+            m_stats.hits++;
+            if (!n->result.found)
+            {
+                m_stats.negativeHits++;
+            }
+            unlink(n);
+            pushFront(n);
+            ResolveResult r = n->result;
+            l.unlock();
+            on_done(r);
+            return;
+        }
+        m_stats.misses++;
+        if (n == nullptr)
+        {
+            n = new Node;
+            n->key = k;
+            m_index.insert(k, n);
+        }
+        else
+        {
+            //Expired, it waits off the recency list until it is answered
+            unlink(n);
+            m_answered--;
+        }
+        n->pending = true;
+        n->generation = generation = m_generation;
+        n->expires = 0;
+        n->result = ResolveResult();
+        n->waiters.append(on_done);
+        m_stats.entries = m_index.size();
+    }
+
+    fetch([this, k, generation](const ResolveResult &r)
+    {
+        complete(k, generation, r);
+    });
+}
+
+void ResolveCache::complete(Key key, quint64 generation, const ResolveResult &r)
+{
+    QList<Done> waiters;
+    {
+        QMutexLocker l(&m_lock);
+        Node *n = m_index.value(key, nullptr);
+        Q_ASSERT(n != nullptr && n->pending);
+        waiters.swap(n->waiters);
+        qint64 ttl = r.found ? m_ttl[key.first] : m_negativeTtl[key.first];
+        if (r.error.length() != 0 || ttl <= 0 || generation != m_generation)
+        {
+            m_index.remove(key);
+            delete n;
+        }
+        else
+        {
+            n->pending = false;
+            n->result = r;
+            n->expires = m_clock.elapsed() + ttl;
+            pushFront(n);
+            m_answered++;
+            evict();
+        }
+        m_stats.entries = m_index.size();
+    }
+    foreach (Done w, waiters)
+    {
+        w(r);
+    }
+}
+
+void ResolveCache::setTtl(BW::ResolveKind kind, qint64 msecs, qint64 negativeMsecs)
+{
+    Q_ASSERT(kind >= 0 && int(kind) < Kinds);
+    QMutexLocker l(&m_lock);
+    m_ttl[kind] = msecs;
+    m_negativeTtl[kind] = negativeMsecs;
+}
+
+bool ResolveCache::keeps(BW::ResolveKind kind)
+{
+    Q_ASSERT(kind >= 0 && int(kind) < Kinds);
+    QMutexLocker l(&m_lock);
+    return m_ttl[kind] > 0;
+}
+
+void ResolveCache::invalidate(BW::ResolveKind kind, const QByteArray &key)
+{
+    QMutexLocker l(&m_lock);
+    Node *n = m_index.value(Key(kind, key), nullptr);
+    if (n != nullptr && !n->pending)
+    {
+        remove(n);
+        m_stats.entries = m_index.size();
+    }
+}
+
+void ResolveCache::clear()
+{
+    QMutexLocker l(&m_lock);
+    //Lookups in flight stay, so later ones still join them
+    Node *n = m_head.next;
+    while (n != &m_head)
+    {
+        Node *next = n->next;
+        remove(n);
+        n = next;
+    }
+    m_generation++;
+    m_stats.entries = m_index.size();
+}
+
+ResolveCacheStats ResolveCache::stats()
+{
+    QMutexLocker l(&m_lock);
+    return m_stats;
+}
+
+void ResolveCache::unlink(Node *n)
+{
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+}
+
+void ResolveCache::pushFront(Node *n)
+{
+    n->prev = &m_head;
+    n->next = m_head.next;
+    m_head.next->prev = n;
+    m_head.next = n;
+}
+
+void ResolveCache::remove(Node *n)
+{
+    unlink(n);
+    m_answered--;
+    m_index.remove(n->key);
+    delete n;
+}
+
+void ResolveCache::evict()
+{
+    while (m_answered > m_maxEntries)
+    {
+        Q_ASSERT(m_head.prev != &m_head);
+        remove(m_head.prev);
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef QTLIBBW_RESOLVECACHE_H
+#define QTLIBBW_RESOLVECACHE_H
+
+#include "bosswave.h"
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QPair>
+#include <QSharedPointer>
+#include <functional>
+
+//Everything any of the lookups answers with, each uses what it needs
+struct ResolveResult
+{
+    ResolveResult() : found(false), validity(BW::StateError) {}
+    QString error;
+    //False for a lookup that came back empty, which is kept for the negative TTL
+    bool found;
+    QByteArray bytes;
+    QString text;
+    QSharedPointer<RoutingObject> ro;
+    BW::RegistryValidity validity;
+};
+
+/*
+ * Answers to alias and registry lookups, keyed by what was looked up. An
+ * answer is reused until its kind's TTL runs out, with a separate (usually
+ * shorter) TTL for lookups that found nothing. Lookups of a key already
+ * being fetched wait for that fetch. Errors are handed to everyone waiting
+ * but never kept. Bounded by count, dropping the least recently used.
+ * Safe to use from any thread.
+ */
+class ResolveCache
+{
+public:
+    typedef std::function<void(const ResolveResult&)> Done;
+    //Asks the agent, calling done once with what it said
+    typedef std::function<void(Done)> Fetch;
+
+    explicit ResolveCache(int maxEntries);
+    ~ResolveCache();
+
+    //Calls on_done with the cached answer, on this thread, or else once
+    //the fetch it shares with any other lookups of the key finishes
+    void lookup(BW::ResolveKind kind, const QByteArray &key, Fetch fetch, Done on_done);
+    void setTtl(BW::ResolveKind kind, qint64 msecs, qint64 negativeMsecs);
+    //False if answers of this kind are not being kept at all
+    bool keeps(BW::ResolveKind kind);
+    //Forgets the answer for key, if one is cached. A lookup in flight still finishes
+    void invalidate(BW::ResolveKind kind, const QByteArray &key);
+    void clear();
+    ResolveCacheStats stats();
+
+private:
+    static const int Kinds = BW::ResolveAccessChain + 1;
+    typedef QPair<int, QByteArray> Key;
+    struct Node
+    {
+        Key key;
+        bool pending;
+        //Fetches started before a clear() are not kept
+        quint64 generation;
+        qint64 expires;
+        ResolveResult result;
+        QList<Done> waiters;
+        Node *prev;
+        Node *next;
+    };
+
+    void complete(Key key, quint64 generation, const ResolveResult &r);
+    void unlink(Node *n);
+    void pushFront(Node *n);
+    void remove(Node *n);
+    void evict();
+
+    QMutex m_lock;
+    QHash<Key, Node*> m_index;
+    //Sentinel of the recency list, most recent after it. Only answered
+    //lookups are on it
+    Node m_head;
+    const int m_maxEntries;
+    //Nodes on the list, which pending lookups are not counted against
+    int m_answered;
+    QElapsedTimer m_clock;
+    qint64 m_ttl[Kinds];
+    qint64 m_negativeTtl[Kinds];
+    quint64 m_generation;
+    ResolveCacheStats m_stats;
+};
+
+#endif // QTLIBBW_RESOLVECACHE_H
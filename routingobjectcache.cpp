@@ -0,0 +1,141 @@
+#include "routingobjectcache.h"
+#include "agentconnection.h"
+#include "allocations.h"
+
+#include <QMutexLocker>
+
+#include <cstring>
+
+namespace
+{
+    //Bigger objects are parsed every time rather than crowd out the rest
+    const int MaxShareOfBytes = 8;
+
+    struct GlobalCache
+    {
+        GlobalCache() : cache(4096, 8 * 1024 * 1024) {}
+        RoutingObjectCache cache;
+    };
+    Q_GLOBAL_STATIC(GlobalCache, globalCache)
+}
+
+RoutingObjectCache::RoutingObjectCache(int maxObjects, int maxBytes)
+    : m_maxObjects(maxObjects), m_maxBytes(maxBytes), m_bytes(0)
+{
+    m_head.prev = &m_head;
+    m_head.next = &m_head;
+}
+
+RoutingObjectCache::~RoutingObjectCache()
+{
+    clear();
+}
+
+RoutingObjectCache* RoutingObjectCache::global()
+{
+    return &globalCache()->cache;
+}
+
+QSharedPointer<RoutingObject> RoutingObjectCache::parse(int ronum, const char *data, int length, Key *key)
+{
+    char *copy = new char[length];
+    memcpy(copy, data, length);
+    RoutingObject *ro;
+    if (ronum == bwpo::num::ROEntity || ronum == bwpo::num::ROEntityWKey)
+    {
+        ro = new Entity(ronum, copy, length);
+    }
+    else
+    {
+        ro = new RoutingObject(ronum, copy, length);
+    }
+    *key = Key(ronum, QByteArray::fromRawData(copy, length));
+    return QSharedPointer<RoutingObject>(ro);
+}
+
+QSharedPointer<RoutingObject> RoutingObjectCache::get(int ronum, const char *data, int length)
+{
+    Key key;
+    if (length > m_maxBytes / MaxShareOfBytes)
+    {
+        return parse(ronum, data, length, &key);
+    }
+
+    {
+        QMutexLocker l(&m_lock);
+        Node *n = m_index.value(Key(ronum, QByteArray::fromRawData(data, length)), nullptr);
+        if (n != nullptr)
+        {
+            unlink(n);
+            pushFront(n);
+            return n->ro;
+        }
+    }
+
+    //Parsed unlocked, another thread may beat us to it
+    QSharedPointer<RoutingObject> ro = parse(ronum, data, length, &key);
+    QMutexLocker l(&m_lock);
+    Node *&slot = m_index[key];
+    if (slot != nullptr)
+    {
+        return slot->ro;
+    }
+    Node *n = new Node;
+    n->key = key;
+    n->ro = ro;
+    slot = n;
+    pushFront(n);
+    m_bytes += length;
+    evict();
+    return ro;
+}
+
+int RoutingObjectCache::size()
+{
+    QMutexLocker l(&m_lock);
+    return m_index.size();
+}
+
+void RoutingObjectCache::clear()
+{
+    QMutexLocker l(&m_lock);
+    Node *n = m_head.next;
+    while (n != &m_head)
+    {
+        Node *next = n->next;
+        delete n;
+        n = next;
+    }
+    m_head.prev = &m_head;
+    m_head.next = &m_head;
+    m_index.clear();
+    m_bytes = 0;
+}
+
+void RoutingObjectCache::unlink(Node *n)
+{
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+}
+
+void RoutingObjectCache::pushFront(Node *n)
+{
+    n->prev = &m_head;
+    n->next = m_head.next;
+    m_head.next->prev = n;
+    m_head.next = n;
+}
+
+void RoutingObjectCache::evict()
+{
+    while (m_index.size() > m_maxObjects || m_bytes > m_maxBytes)
+    {
+        Node *n = m_head.prev;
+        Q_ASSERT(n != &m_head);
+        unlink(n);
+        //The key refers into the object, so it goes from the index first
+        m_index.remove(n->key);
+        m_bytes -= n->key.second.size();
+        delete n;
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef QTLIBBW_ROUTINGOBJECTCACHE_H
+#define QTLIBBW_ROUTINGOBJECTCACHE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
+#include <QPair>
+#include <QSharedPointer>
+
+QT_FORWARD_DECLARE_CLASS(RoutingObject)
+
+/*
+ * Parsed routing objects keyed by their number and contents. The same
+ * entities and DOTs turn up in frame after frame, so received ROs are
+ * looked up here: each distinct one is copied, parsed (entities come back
+ * as Entity) and, if anyone asks, verified only once, and every frame that
+ * carries it shares the result. Shared objects must be treated as read
+ * only. Bounded by count and by bytes, dropping the least recently used.
+ * Safe to use from any thread.
+ */
+class RoutingObjectCache
+{
+public:
+    RoutingObjectCache(int maxObjects, int maxBytes);
+    ~RoutingObjectCache();
+
+    //The cache received frames use
+    static RoutingObjectCache* global();
+
+    //The parsed object with these contents, made on a miss
+    QSharedPointer<RoutingObject> get(int ronum, const char *data, int length);
+    int size();
+    void clear();
+
+private:
+    //The contents part refers to the cached object's own copy
+    typedef QPair<int, QByteArray> Key;
+    struct Node
+    {
+        Key key;
+        QSharedPointer<RoutingObject> ro;
+        Node *prev;
+        Node *next;
+    };
+
+    static QSharedPointer<RoutingObject> parse(int ronum, const char *data, int length, Key *key);
+    void unlink(Node *n);
+    void pushFront(Node *n);
+    void evict();
+
+    QMutex m_lock;
+    QHash<Key, Node*> m_index;
+    //Sentinel of the recency list, most recent after it
+    Node m_head;
+    const int m_maxObjects;
+    const int m_maxBytes;
+    int m_bytes;
+};
+
+#endif // QTLIBBW_ROUTINGOBJECTCACHE_H
@@ -0,0 +1,602 @@
+#include <QtTest>
+#include <QBuffer>
+#include <QVector>
+
+#include <agentconnection.h>
+#include <allocations.h>
+#include <crypto.h>
+#include <frameparser.h>
+#include <message.h>
+#include <ed25519/ed25519.h>
+
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+    //Every allocation in the process goes through the operators below, so
+    //the difference in this across a stretch of code is what it allocated
+    QBasicAtomicInt allocations = Q_BASIC_ATOMIC_INITIALIZER(0);
+}
+
+void* operator new(std::size_t size)
+{
+    allocations.fetchAndAddRelaxed(1);
+    void *p = std::malloc(size == 0 ? 1 : size);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    std::free(p);
+}
+
+class Bench : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+    void test_verify_batch();
+    void bench_verify_data();
+    void bench_verify();
+    void bench_frame_allocations_data();
+    void bench_frame_allocations();
+    void test_split_frames();
+    void test_malformed_data();
+    void test_malformed();
+    void test_ignored_frames_data();
+    void test_ignored_frames();
+    void test_ignore_mid_frame_data();
+    void test_ignore_mid_frame();
+    void bench_parse_data();
+    void bench_parse();
+    void bench_parse_allocations_data();
+    void bench_parse_allocations();
+
+private:
+    //Only used to number frames, it never connects
+    AgentConnection *m_agent;
+};
+
+namespace
+{
+    enum VerifyMode
+    {
+        Single,
+        Batch
+    };
+
+    //Signatures by n different keys over URI-sized blobs, as a batch of
+    //routing objects would have them
+    QVector<VerifyItem> signedItems(int n)
+    {
+        QVector<VerifyItem> items;
+        for (int i = 0; i < n; i++)
+        {
+            QByteArray sk(32, 0);
+            for (int k = 0; k < 32; k++)
+            {
+                sk[k] = char(i * 31 + k * 7 + 1);
+            }
+            QByteArray vk(32, 0);
+            ed25519_publickey((const unsigned char*) sk.constData(), (unsigned char*) vk.data());
+            VerifyItem it;
+            it.vk = vk;
+            it.data = "scratch.ns/devices/s.hue/" + QByteArray::number(i) + "/i.xbos.light/signal/info";
+            it.sig = QByteArray(64, 0);
+            SignBlob(sk, it.vk, &it.data, &it.sig);
+            items.append(it);
+        }
+        return items;
+    }
+
+    //A message as a subscription delivers it: a handful of headers and two
+    //POs, in the wire format
+    QByteArray messageFrame(quint32 seqno, bool finished)
+    {
+        Frame f(nullptr, Frame::RESULT, seqno);
+        f.addHeader("uri", "scratch.ns/devices/s.hue/4/i.xbos.light/signal/info");
+        f.addHeader("from", "fF5ne3OVNB4DX-2bALy_C2ZYUljHB6ZK8XJSgYvvCxM=");
+        f.addHeader("unpack", "true");
+        f.addHeader("hash", "nbYUFvjy1-3Qqp9KMl9yBkN4aNNMSqwi3C9-JFJ47Yk=");
+        f.addHeader("finished", finished ? "true" : "false");
+        f.addPayloadObject(createBasePayloadObject(bwpo::num::MsgPack, QByteArray(180, 'm')));
+        f.addPayloadObject(createBasePayloadObject(bwpo::num::Text, QByteArray(40, 't')));
+        QByteArray out;
+        f.appendTo(out);
+        return out;
+    }
+
+    enum BuildMode
+    {
+        HeapObjects,
+        Parser
+    };
+
+    quint32 decimal(const char *p, const char *e)
+    {
+        quint32 v = 0;
+        for (; p != e; p++)
+        {
+            v = v * 10 + quint32(*p - '0');
+        }
+        return v;
+    }
+
+    //Builds the frame in data the way frames were built before they had an
+    //arena: a copy and an object on the heap for every header and PO
+    PFrame buildOnHeap(AgentConnection *agent, const QByteArray &data)
+    {
+        const char *p = data.constData();
+        char type[5];
+        memcpy(type, p, 4);
+        type[4] = 0;
+        PFrame f = agent->newFrame(type, decimal(p + 16, p + 26));
+        p += 27;
+        while (memcmp(p, "end\n", 4) != 0)
+        {
+            const char *nl = static_cast<const char*>(memchr(p, '\n', 256));
+            const char *sp = nl;
+            while (sp[-1] != ' ')
+            {
+                sp--;
+            }
+            int length = int(decimal(sp, nl));
+            char *dat = new char[length];
+            memcpy(dat, nl + 1, length);
+            if (p[0] == 'k')
+            {
+                f->addHeader(new Header(QString::fromLatin1(p + 3, int(sp - 1 - (p + 3))), dat, length));
+            }
+            else
+            {
+                const char *colon = static_cast<const char*>(memchr(p, ':', sp - p));
+                f->addPayloadObject(PayloadObject::load(int(decimal(colon + 1, sp - 1)), dat, length));
+            }
+            p = nl + 1 + length + 1;
+        }
+        return f;
+    }
+
+    //Seqnos of the frames next() hands out until it wants more data.
+    //malformed is set if it stopped on bad input instead
+    QList<quint32> drain(FrameParser &parser, AgentConnection *agent, bool *malformed = nullptr)
+    {
+        QList<quint32> seqnos;
+        forever
+        {
+            PFrame f;
+            FrameParser::Result r = parser.next(agent, f);
+            if (r == FrameParser::FrameReady)
+            {
+                seqnos.append(f->seqno());
+                continue;
+            }
+            if (malformed != nullptr)
+            {
+                *malformed = r == FrameParser::Malformed;
+            }
+            return seqnos;
+        }
+    }
+
+    //Feeds data to the parser chunk bytes at a time
+    QList<quint32> feed(FrameParser &parser, AgentConnection *agent, const QByteArray &data, int chunk)
+    {
+        QList<quint32> seqnos;
+        for (int i = 0; i < data.size(); i += chunk)
+        {
+            parser.append(data.constData() + i, qMin(chunk, data.size() - i));
+            seqnos += drain(parser, agent);
+        }
+        return seqnos;
+    }
+
+    enum ParseMode
+    {
+        Lines,
+        Incremental
+    };
+
+    //The old parser only ever saw whole frames, see LineParser
+    void addParseRows()
+    {
+        QTest::addColumn<int>("mode");
+        QTest::addColumn<int>("framesPerRead");
+        QTest::addColumn<int>("readsPerFrame");
+        QTest::newRow("onArrivedData, 1 frame per read") << int(Lines) << 1 << 1;
+        QTest::newRow("FrameParser, 1 frame per read") << int(Incremental) << 1 << 1;
+        QTest::newRow("onArrivedData, 64 frames per read") << int(Lines) << 64 << 1;
+        QTest::newRow("FrameParser, 64 frames per read") << int(Incremental) << 64 << 1;
+        QTest::newRow("FrameParser, 3 reads per frame") << int(Incremental) << 1 << 3;
+    }
+
+    //Frames parsed the way onArrivedData did before FrameParser, with a
+    //QBuffer in place of the socket. It took a frame to be all there once
+    //its header was, so it cannot be given frames split across reads. The
+    //queued calls it made for every frame are left out, which flatters it
+    class LineParser
+    {
+    public:
+        explicit LineParser(AgentConnection *agent)
+            : m_agent(agent)
+        {
+            m_buf.open(QIODevice::ReadWrite);
+        }
+
+        void append(const QByteArray &read)
+        {
+            qint64 pos = m_buf.pos();
+            m_buf.seek(m_buf.size());
+            m_buf.write(read);
+            m_buf.seek(pos);
+        }
+
+        //A null frame if there is not a whole one
+        PFrame next()
+        {
+            if (m_buf.bytesAvailable() < 27)
+                return PFrame();
+            char hdr[28];
+            m_buf.read(hdr, 27);
+            hdr[4] = 0;
+            hdr[15] = 0;
+            hdr[26] = 0;
+            int length = QString(&hdr[5]).toInt();
+            Q_UNUSED(length);
+            int seq = QString(&hdr[16]).toInt();
+            PFrame f = m_agent->newFrame(&hdr[0], seq);
+            char linebuf[256];
+            forever
+            {
+                qint64 linelen = m_buf.readLine(linebuf, 256);
+                Q_ASSERT(linelen > 0 && linelen < 255);
+                linebuf[linelen - 1] = 0;
+                QString line(linebuf);
+                QStringList tokens = line.split(' ');
+                if (tokens[0] == "end")
+                    return f;
+                int length = tokens[2].toInt();
+                char *dat = new char[length];
+                m_buf.read(dat, length);
+                if (tokens[0] == "kv")
+                    f->addHeader(new Header(tokens[1], dat, length));
+                else if (tokens[0] == "po")
+                    f->addPayloadObject(PayloadObject::load(tokens[1].split(':')[1].toInt(), dat, length));
+                else
+                    f->addRoutingObject(new RoutingObject(tokens[1].toInt(), dat, length));
+                char eatline[2];
+                m_buf.read(&eatline[0], 1);
+            }
+        }
+
+    private:
+        AgentConnection *m_agent;
+        QBuffer m_buf;
+    };
+
+    //1000 frames, cut up into reads the way a socket might deliver them
+    QVector<QByteArray> parseReads(int framesPerRead, int readsPerFrame)
+    {
+        QVector<QByteArray> reads;
+        QByteArray read;
+        for (int i = 0; i < 1000; i++)
+        {
+            QByteArray f = messageFrame(quint32(i + 1), true);
+            if (readsPerFrame > 1)
+            {
+                int step = (f.size() + readsPerFrame - 1) / readsPerFrame;
+                for (int k = 0; k < f.size(); k += step)
+                {
+                    reads.append(f.mid(k, step));
+                }
+                continue;
+            }
+            read += f;
+            if ((i + 1) % framesPerRead == 0)
+            {
+                reads.append(read);
+                read.clear();
+            }
+        }
+        if (!read.isEmpty())
+        {
+            reads.append(read);
+        }
+        return reads;
+    }
+
+    int parseAll(FrameParser &parser, AgentConnection *agent, const QVector<QByteArray> &reads)
+    {
+        int n = 0;
+        for (int i = 0; i < reads.size(); i++)
+        {
+            parser.append(reads[i].constData(), reads[i].size());
+            PFrame f;
+            while (parser.next(agent, f) == FrameParser::FrameReady)
+            {
+                n++;
+                f.clear();
+            }
+        }
+        return n;
+    }
+
+    int parseAll(int mode, AgentConnection *agent, const QVector<QByteArray> &reads)
+    {
+        if (mode == Incremental)
+        {
+            FrameParser parser;
+            return parseAll(parser, agent, reads);
+        }
+        LineParser parser(agent);
+        int n = 0;
+        for (int i = 0; i < reads.size(); i++)
+        {
+            parser.append(reads[i]);
+            while (!parser.next().isNull())
+            {
+                n++;
+            }
+        }
+        return n;
+    }
+}
+
+void Bench::initTestCase()
+{
+    //It runs a thread of its own, which is left to the end of the process
+    m_agent = new AgentConnection();
+}
+
+void Bench::test_verify_batch()
+{
+    QVector<VerifyItem> items = signedItems(100);
+    QVector<bool> valid;
+    QVERIFY(VerifyBatch(items, &valid));
+    QCOMPARE(valid, QVector<bool>(100, true));
+
+    //One bad signature fails the batch, and only that one is flagged
+    items[37].sig[5] = char(items[37].sig[5] ^ 0x01);
+    QVERIFY(!VerifyBatch(items, &valid));
+    for (int i = 0; i < items.size(); i++)
+    {
+        QCOMPARE(valid[i], i != 37);
+    }
+}
+
+void Bench::bench_verify_data()
+{
+    //Each iteration checks every signature of the row, so signatures per
+    //second is the count over the time per iteration
+    QTest::addColumn<int>("count");
+    QTest::addColumn<int>("mode");
+    QTest::newRow("VerifyBlob 64") << 64 << int(Single);
+    QTest::newRow("VerifyBatch 64") << 64 << int(Batch);
+    QTest::newRow("VerifyBlob 1024") << 1024 << int(Single);
+    QTest::newRow("VerifyBatch 1024") << 1024 << int(Batch);
+}
+
+void Bench::bench_verify()
+{
+    QFETCH(int, count);
+    QFETCH(int, mode);
+    QVector<VerifyItem> items = signedItems(count);
+    bool ok = true;
+    QBENCHMARK
+    {
+        if (mode == Single)
+        {
+            for (int i = 0; i < items.size(); i++)
+            {
+                ok &= VerifyBlob(items[i].vk, items[i].sig, items[i].data);
+            }
+        }
+        else
+        {
+            ok &= VerifyBatch(items);
+        }
+    }
+    QVERIFY(ok);
+}
+
+void Bench::bench_frame_allocations_data()
+{
+    QTest::addColumn<int>("mode");
+    QTest::newRow("heap objects") << int(HeapObjects);
+    QTest::newRow("FrameParser") << int(Parser);
+}
+
+//Reports allocations per frame, from the bytes to the finished frame and
+//back to nothing
+void Bench::bench_frame_allocations()
+{
+    QFETCH(int, mode);
+    const int frames = 1000;
+    QVector<QByteArray> data;
+    for (int i = 0; i < frames; i++)
+    {
+        data.append(messageFrame(quint32(i + 1), true));
+    }
+    FrameParser parser;
+    int count = 0;
+    int before = allocations.loadAcquire();
+    for (int i = 0; i < frames; i++)
+    {
+        PFrame f;
+        if (mode == HeapObjects)
+        {
+            f = buildOnHeap(m_agent, data[i]);
+        }
+        else
+        {
+            parser.append(data[i].constData(), data[i].size());
+            if (parser.next(m_agent, f) != FrameParser::FrameReady)
+                break;
+        }
+        count += f->getPayloadObjects().size() == 2;
+    }
+    int used = allocations.loadAcquire() - before;
+    QCOMPARE(count, frames);
+    QTest::setBenchmarkResult(qreal(used) / frames, QTest::Events);
+}
+
+void Bench::test_split_frames()
+{
+    QByteArray data = messageFrame(5, true);
+    //Every place a read can end, including partway through the header
+    for (int cut = 1; cut < data.size(); cut++)
+    {
+        FrameParser parser;
+        parser.append(data.constData(), cut);
+        QVERIFY(drain(parser, m_agent).isEmpty());
+        parser.append(data.constData() + cut, data.size() - cut);
+        PFrame f;
+        QCOMPARE(parser.next(m_agent, f), FrameParser::FrameReady);
+        QCOMPARE(f->seqno(), quint32(5));
+        QVERIFY(f->isType(Frame::RESULT));
+        QCOMPARE(f->getHeaderS("uri"), QString("scratch.ns/devices/s.hue/4/i.xbos.light/signal/info"));
+        QVERIFY(f->getHeaderBool(Header::KeyFinished));
+        QCOMPARE(f->getPayloadObjects().size(), 2);
+        QCOMPARE(f->getPayloadObjects()[0]->contentArray(), QByteArray(180, 'm'));
+        QCOMPARE(f->getPayloadObjects()[1]->contentArray(), QByteArray(40, 't'));
+        QCOMPARE(parser.next(m_agent, f), FrameParser::NeedMore);
+    }
+
+    //A byte at a time, with several frames in the stream
+    FrameParser parser;
+    QByteArray stream = messageFrame(1, false) + messageFrame(2, false) + messageFrame(3, true);
+    QCOMPARE(feed(parser, m_agent, stream, 1), QList<quint32>() << 1 << 2 << 3);
+}
+
+void Bench::test_malformed_data()
+{
+    QTest::addColumn<QByteArray>("data");
+    QByteArray header("rslt 0000000000 0000000001\n");
+    QTest::newRow("header separator") << QByteArray("rslt-0000000000 0000000001\nend\n");
+    QTest::newRow("header seqno") << QByteArray("rslt 0000000000 00000x0001\nend\n");
+    QTest::newRow("object kind") << QByteArray(header + "zz foo 3\nabc\nend\n");
+    QTest::newRow("object length") << QByteArray(header + "kv foo 3x\nabc\nend\n");
+    QTest::newRow("object too long") << QByteArray(header + "po :1 99999999999\nend\n");
+    QTest::newRow("po number") << QByteArray(header + "po 2.0.0.0 3\nabc\nend\n");
+    QTest::newRow("body newline") << QByteArray(header + "kv foo 3\nabcdend\n");
+    QTest::newRow("line too long") << QByteArray(header + QByteArray(300, 'k'));
+}
+
+void Bench::test_malformed()
+{
+    QFETCH(QByteArray, data);
+    FrameParser parser;
+    parser.append(data.constData(), data.size());
+    bool malformed = false;
+    QVERIFY(drain(parser, m_agent, &malformed).isEmpty());
+    QVERIFY(malformed);
+
+    //Starting over after reset works
+    parser.reset();
+    QByteArray good = messageFrame(2, true);
+    parser.append(good.constData(), good.size());
+    QCOMPARE(drain(parser, m_agent, &malformed), QList<quint32>() << 2);
+    QVERIFY(!malformed);
+}
+
+void Bench::test_ignored_frames_data()
+{
+    QTest::addColumn<int>("chunk");
+    QTest::newRow("byte by byte") << 1;
+    QTest::newRow("7 bytes") << 7;
+    QTest::newRow("whole") << 1000000;
+}
+
+void Bench::test_ignored_frames()
+{
+    QFETCH(int, chunk);
+    FrameParser parser;
+    parser.ignore(7);
+    //Frames for 7 are skipped up to and including the one that finishes it,
+    //after which 7 is an ordinary seqno again
+    QByteArray stream = messageFrame(7, false) + messageFrame(8, false) + messageFrame(7, true) +
+                        messageFrame(8, true) + messageFrame(7, true);
+    QCOMPARE(feed(parser, m_agent, stream, chunk), QList<quint32>() << 8 << 8 << 7);
+}
+
+void Bench::test_ignore_mid_frame_data()
+{
+    QTest::addColumn<int>("cut");
+    QByteArray f = messageFrame(7, true);
+    QTest::newRow("after the header") << 27;
+    QTest::newRow("in a header body") << 40;
+    QTest::newRow("in a PO body") << f.indexOf("mmm") + 10;
+    QTest::newRow("before end") << f.size() - 2;
+}
+
+void Bench::test_ignore_mid_frame()
+{
+    QFETCH(int, cut);
+    FrameParser parser;
+    QByteArray first = messageFrame(7, true);
+    parser.append(first.constData(), cut);
+    QVERIFY(drain(parser, m_agent).isEmpty());
+    parser.ignore(7);
+    QByteArray rest = first.mid(cut) + messageFrame(9, true) + messageFrame(7, true);
+    parser.append(rest.constData(), rest.size());
+    //The frame in progress finished 7, so the next one for it is handed out
+    QCOMPARE(drain(parser, m_agent), QList<quint32>() << 9 << 7);
+}
+
+void Bench::bench_parse_data()
+{
+    addParseRows();
+}
+
+//Each iteration parses 1000 frames, so frames per second is a million
+//over the milliseconds per iteration
+void Bench::bench_parse()
+{
+    QFETCH(int, mode);
+    QFETCH(int, framesPerRead);
+    QFETCH(int, readsPerFrame);
+    QVector<QByteArray> reads = parseReads(framesPerRead, readsPerFrame);
+    int n = 0;
+    QBENCHMARK
+    {
+        n = parseAll(mode, m_agent, reads);
+    }
+    QCOMPARE(n, 1000);
+}
+
+void Bench::bench_parse_allocations_data()
+{
+    addParseRows();
+}
+
+//Reports allocations per frame
+void Bench::bench_parse_allocations()
+{
+    QFETCH(int, mode);
+    QFETCH(int, framesPerRead);
+    QFETCH(int, readsPerFrame);
+    QVector<QByteArray> reads = parseReads(framesPerRead, readsPerFrame);
+    int before = allocations.loadAcquire();
+    int n = parseAll(mode, m_agent, reads);
+    int used = allocations.loadAcquire() - before;
+    QCOMPARE(n, 1000);
+    QTest::setBenchmarkResult(qreal(used) / n, QTest::Events);
+}
+
+QTEST_GUILESS_MAIN(Bench)
+
+#include "bench.moc"
@@ -0,0 +1,11 @@
+# Benchmarks and tests for the library itself: qmake tests/bench && make check
+TEMPLATE = app
+TARGET = bench
+QT += testlib
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+include(../../bosswave.pri)
+
+SOURCES += \
+    bench.cpp
@@ -0,0 +1,214 @@
+#include "threaddispatcher.h"
+
+#include <QCoreApplication>
+#include <QEvent>
+#include <QHash>
+#include <QReadWriteLock>
+#include <QThread>
+#include <QVector>
+
+namespace
+{
+    const QEvent::Type DispatchEvent = static_cast<QEvent::Type>(QEvent::registerEventType());
+
+    //Tasks run per event before we give the rest of the event loop a turn
+    const int MaxBatch = 1024;
+
+    struct Registry
+    {
+        QReadWriteLock lock;
+        QHash<QThread*, PThreadDispatcher> dispatchers;
+    };
+    Q_GLOBAL_STATIC(Registry, registry)
+
+    struct Workers
+    {
+        Workers() : turn(0)
+        {
+            int n = qMax(QThread::idealThreadCount(), 1);
+            for (int i = 0; i < n; i++)
+            {
+                QThread *t = new QThread();
+                t->setObjectName(QStringLiteral("bw worker %1").arg(i));
+                t->start();
+                threads.append(t);
+            }
+        }
+        ~Workers()
+        {
+            foreach (QThread *t, threads)
+            {
+                t->quit();
+                t->wait();
+                delete t;
+            }
+        }
+        QVector<QThread*> threads;
+        QAtomicInt turn;
+    };
+    Q_GLOBAL_STATIC(Workers, workers)
+}
+
+ThreadDispatcher::ThreadDispatcher()
+    : QObject(nullptr), m_head(&m_stub), m_tail(&m_stub), m_scheduled(0), m_finished(0)
+{
+    m_stub.next.store(nullptr);
+}
+
+ThreadDispatcher::~ThreadDispatcher()
+{
+    //Whatever is left can no longer run
+    while (Node *n = pop())
+        delete n;
+}
+
+PThreadDispatcher ThreadDispatcher::forThread(QThread *t)
+{
+    Registry *r = registry();
+    {
+        QReadLocker l(&r->lock);
+        PThreadDispatcher d = r->dispatchers.value(t);
+        if (!d.isNull())
+            return d;
+    }
+    if (t->isFinished())
+    {
+        //Nothing would ever run what is posted to it, so it is all dropped
+        PThreadDispatcher nd(new ThreadDispatcher());
+        nd->m_finished.storeRelease(1);
+        return nd;
+    }
+    QWriteLocker l(&r->lock);
+    PThreadDispatcher &d = r->dispatchers[t];
+    if (d.isNull())
+    {
+        d = PThreadDispatcher(new ThreadDispatcher());
+        d->moveToThread(t);
+        //This is emitted from t itself. Unless someone is posting to it right
+        //now, the dispatcher dies on its own thread
+        QObject::connect(t, &QThread::finished, [t]
+        {
+            PThreadDispatcher d;
+            {
+                Registry *r = registry();
+                QWriteLocker l(&r->lock);
+                d = r->dispatchers.take(t);
+            }
+            if (!d.isNull())
+                d->retire();
+        });
+    }
+    return d;
+}
+
+void ThreadDispatcher::post(std::function<void()> task)
+{
+    if (m_finished.loadAcquire())
+        return;
+    Node *n = new Node();
+    n->task = std::move(task);
+    push(n);
+    if (m_finished.loadAcquire())
+    {
+        //The thread finished as we pushed, and may not have seen it
+        discard();
+        return;
+    }
+    schedule();
+}
+
+void ThreadDispatcher::retire()
+{
+    //Ordered against the pushes that check it afterwards
+    m_finished.fetchAndStoreOrdered(1);
+    discard();
+}
+
+void ThreadDispatcher::discard()
+{
+    //A push that is halfway through is left alone here, its producer sees
+    //m_finished and comes back for it
+    QMutexLocker l(&m_discardLock);
+    while (Node *n = pop())
+        delete n;
+}
+
+void ThreadDispatcher::schedule()
+{
+    //Only the transition from idle needs an event, the pending one will
+    //pick up everything pushed before the consumer marks the queue idle
+    if (m_scheduled.testAndSetOrdered(0, 1))
+        QCoreApplication::postEvent(this, new QEvent(DispatchEvent));
+}
+
+bool ThreadDispatcher::event(QEvent *e)
+{
+    if (e->type() != DispatchEvent)
+        return QObject::event(e);
+    //Mark idle before draining: a push we do not see will post again
+    m_scheduled.fetchAndStoreOrdered(0);
+    drain();
+    return true;
+}
+
+void ThreadDispatcher::drain()
+{
+    for (int i = 0; i < MaxBatch; i++)
+    {
+        Node *n = pop();
+        if (n == nullptr)
+            return;
+        n->task();
+        delete n;
+    }
+    //Still busy, continue after other events had a chance
+    schedule();
+}
+
+//This is Dmitry Vyukov's intrusive MPSC queue. Producers only touch m_head,
+//the consumer only touches m_tail, and m_stub keeps the list non-empty.
+void ThreadDispatcher::push(Node *n)
+{
+    n->next.store(nullptr);
+    Node *prev = m_head.fetchAndStoreOrdered(n);
+    prev->next.storeRelease(n);
+}
+
+ThreadDispatcher::Node* ThreadDispatcher::pop()
+{
+    Node *tail = m_tail;
+    Node *next = tail->next.loadAcquire();
+    if (tail == &m_stub)
+    {
+        if (next == nullptr)
+            return nullptr;
+        m_tail = next;
+        tail = next;
+        next = next->next.loadAcquire();
+    }
+    if (next != nullptr)
+    {
+        m_tail = next;
+        return tail;
+    }
+    if (tail != m_head.loadAcquire())
+    {
+        //A producer is halfway through a push, it will schedule us again
+        return nullptr;
+    }
+    push(&m_stub);
+    next = tail->next.loadAcquire();
+    if (next != nullptr)
+    {
+        m_tail = next;
+        return tail;
+    }
+    return nullptr;
+}
+
+QThread* WorkerPool::next()
+{
+    Workers *w = workers();
+    uint i = uint(w->turn.fetchAndAddRelaxed(1));
+    return w->threads[i % uint(w->threads.size())];
+}
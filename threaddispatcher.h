@@ -0,0 +1,79 @@
+#ifndef QTLIBBW_THREADDISPATCHER_H
+#define QTLIBBW_THREADDISPATCHER_H
+
+#include <QObject>
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QMutex>
+#include <QSharedPointer>
+#include <functional>
+
+QT_FORWARD_DECLARE_CLASS(QThread)
+
+class ThreadDispatcher;
+typedef QSharedPointer<ThreadDispatcher> PThreadDispatcher;
+
+/*
+ * Runs tasks on a particular thread. Any thread may post; tasks go onto a
+ * lock-free multi-producer single-consumer queue, and only the post that
+ * finds the queue idle sends an event to the target thread. That event
+ * drains everything that was queued by the time it runs, so a burst of
+ * tasks costs one posted event rather than one each.
+ *
+ * Once its thread has finished, what is still queued is dropped, and so is
+ * anything posted after that. A dispatcher stays valid for as long as a
+ * reference to it is held, so a post racing the end of the thread is safe.
+ */
+class ThreadDispatcher : public QObject
+{
+public:
+    //The dispatcher for t, created on first use
+    static PThreadDispatcher forThread(QThread *t);
+
+    void post(std::function<void()> task);
+
+    ~ThreadDispatcher();
+
+protected:
+    bool event(QEvent *e) override;
+
+private:
+    ThreadDispatcher();
+
+    struct Node
+    {
+        QAtomicPointer<Node> next;
+        std::function<void()> task;
+    };
+
+    void push(Node *n);
+    Node* pop();
+    void drain();
+    void schedule();
+    //Called on the thread as it finishes, from then on tasks are dropped
+    void retire();
+    //Frees whatever is queued once nothing will run it
+    void discard();
+
+    QAtomicPointer<Node> m_head;
+    Node *m_tail;
+    Node m_stub;
+    QAtomicInt m_scheduled;
+    QAtomicInt m_finished;
+    //Once finished any thread may pop, one at a time
+    QMutex m_discardLock;
+};
+
+/*
+ * A few threads, one per core, for work that should stay off both the GUI
+ * thread and the I/O threads. Each is a plain event loop, so what is posted
+ * to one through its ThreadDispatcher runs in order.
+ */
+class WorkerPool
+{
+public:
+    //The next worker in turn. The threads are started on first use
+    static QThread* next();
+};
+
+#endif // QTLIBBW_THREADDISPATCHER_H
@@ -0,0 +1,155 @@
+#include "timerwheel.h"
+
+TimerWheel::TimerWheel(int tickMsecs)
+    : m_tick(qMax(tickMsecs, 1)), m_now(0)
+{
+    for (int l = 0; l < Levels; l++)
+    {
+        for (int s = 0; s < SlotsPerLevel; s++)
+        {
+            Node *head = &m_slots[l][s];
+            head->prev = head;
+            head->next = head;
+        }
+    }
+}
+
+TimerWheel::~TimerWheel()
+{
+    clear();
+}
+
+void TimerWheel::schedule(quint32 id, qint64 at)
+{
+    Node *&n = m_nodes[id];
+    if (n == nullptr)
+    {
+        n = new Node();
+        n->id = id;
+    }
+    else
+    {
+        unlink(n);
+    }
+    //Rounded up, a deadline is never early. One that is already due goes
+    //in the next tick, the current one has been processed
+    n->due = qMax((at + m_tick - 1) / m_tick, m_now + 1);
+    place(n);
+}
+
+void TimerWheel::cancel(quint32 id)
+{
+    Node *n = m_nodes.take(id);
+    if (n != nullptr)
+    {
+        unlink(n);
+        delete n;
+    }
+}
+
+void TimerWheel::clear()
+{
+    foreach (Node *n, m_nodes)
+    {
+        unlink(n);
+        delete n;
+    }
+    m_nodes.clear();
+}
+
+bool TimerWheel::isEmpty() const
+{
+    return m_nodes.isEmpty();
+}
+
+int TimerWheel::tickMsecs() const
+{
+    return m_tick;
+}
+
+void TimerWheel::unlink(Node *n)
+{
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+    n->prev = n;
+    n->next = n;
+}
+
+void TimerWheel::place(Node *n)
+{
+    qint64 delta = n->due - m_now;
+    int level = 0;
+    while (level < Levels - 1 && delta >= (qint64(1) << (LevelBits * (level + 1))))
+    {
+        level++;
+    }
+    //Beyond the last level it waits in the farthest slot, and is placed
+    //again each time that slot comes round
+    qint64 span = qint64(1) << (LevelBits * Levels);
+    qint64 due = delta < span ? n->due : m_now + span - 1;
+    int slot = int((due >> (LevelBits * level)) & (SlotsPerLevel - 1));
+    Node *head = &m_slots[level][slot];
+    n->prev = head->prev;
+    n->next = head;
+    head->prev->next = n;
+    head->prev = n;
+}
+
+void TimerWheel::cascade(int level, int slot)
+{
+    Node *head = &m_slots[level][slot];
+    Node *n = head->next;
+    head->prev = head;
+    head->next = head;
+    while (n != head)
+    {
+        Node *next = n->next;
+        place(n);
+        n = next;
+    }
+}
+
+void TimerWheel::advance(qint64 now, QList<quint32> *out)
+{
+    qint64 target = now / m_tick;
+    if (m_nodes.isEmpty())
+    {
+        //Nothing to step through
+        m_now = qMax(m_now, target);
+        return;
+    }
+    while (m_now < target)
+    {
+        m_now++;
+        //Coming round to the start of a level's rotation brings the next
+        //slot of the level above down. What it holds is due this tick at
+        //the earliest, so it is placed before this tick's slot is emptied
+        for (int l = 1; l < Levels; l++)
+        {
+            if ((m_now & ((qint64(1) << (LevelBits * l)) - 1)) != 0)
+            {
+                break;
+            }
+            cascade(l, int((m_now >> (LevelBits * l)) & (SlotsPerLevel - 1)));
+        }
+        Node *head = &m_slots[0][m_now & (SlotsPerLevel - 1)];
+        Node *n = head->next;
+        while (n != head)
+        {
+            Node *next = n->next;
+            if (n->due <= m_now)
+            {
+                unlink(n);
+                m_nodes.remove(n->id);
+                out->append(n->id);
+                delete n;
+            }
+            n = next;
+        }
+        if (m_nodes.isEmpty())
+        {
+            m_now = target;
+            return;
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef QTLIBBW_TIMERWHEEL_H
+#define QTLIBBW_TIMERWHEEL_H
+
+#include <QHash>
+#include <QList>
+#include <QtGlobal>
+
+/*
+ * Deadlines for any number of ids, kept in a hierarchical timing wheel.
+ * Each level has 64 slots, the first one tick wide each and every level
+ * after 64 times wider than the one below. A deadline goes into the slot
+ * of the coarsest level it fits, and is moved down a level each time the
+ * level below comes round to it, so arming, disarming and expiring are
+ * all constant time however many deadlines there are. One clock tick is
+ * the resolution; deadlines never fire early, and at most a tick late.
+ * Not thread safe, it belongs to whoever drives it.
+ */
+class TimerWheel
+{
+public:
+    explicit TimerWheel(int tickMsecs);
+    ~TimerWheel();
+
+    //Arms id to expire at msecs on the clock given to advance, replacing
+    //any deadline it had
+    void schedule(quint32 id, qint64 at);
+    void cancel(quint32 id);
+    void clear();
+    //Moves the clock on to now, appending the ids that expired to out
+    void advance(qint64 now, QList<quint32> *out);
+    bool isEmpty() const;
+    int tickMsecs() const;
+
+private:
+    static const int LevelBits = 6;
+    static const int SlotsPerLevel = 1 << LevelBits;
+    static const int Levels = 4;
+
+    struct Node
+    {
+        quint32 id;
+        //Tick at which it expires
+        qint64 due;
+        Node *prev;
+        Node *next;
+    };
+
+    void place(Node *n);
+    static void unlink(Node *n);
+    //Puts everything in a slot back, a level down
+    void cascade(int level, int slot);
+
+    int m_tick;
+    //Ticks that have been processed
+    qint64 m_now;
+    //Circular lists, the heads themselves are never removed
+    Node m_slots[Levels][SlotsPerLevel];
+    QHash<quint32, Node*> m_nodes;
+};
+
+#endif // QTLIBBW_TIMERWHEEL_H